@@ -1,30 +1,29 @@
 #include "chess.h"
-#include <cstdlib>
 
-move random(const game& g, color c, const move* moves, uint8_t length) {
-    return moves[rand() % length];
+move random(const game& g, color c, const move_list& moves) {
+    return moves.moves[random_number() % moves.length];
 }
 
-move min_opponent_moves(const game& g, color c, const move* moves, uint8_t length) {
-    move options[MAX_MOVES];
-    uint8_t num_options = 0;
-    uint8_t min = 255;
-    for (uint8_t i = 0; i < length; i ++) {
-        game copy = g;
-        const move* candidate = moves + i;
-        move_piece(copy, *candidate);
+move min_opponent_moves(const game& g, color c, const move_list& moves) {
+    move_list options;
+    uint16_t min = MAX_MOVES;
+    game copy = g;
+    for (uint16_t i = 0; i < moves.length && !(options.length && decider_stopped()); i ++) {
+        move candidate = moves.moves[i];
+        undo u;
+        make_move(copy, candidate, u);
 
-        move oppt_moves[MAX_MOVES];
-        uint8_t num_oppt_moves = 0;
-        add_moves(copy, c, oppt_moves, num_oppt_moves);
-        if (num_oppt_moves < min) {
-            num_options = 0;
-            options[num_options ++] = *candidate;
-            min = num_oppt_moves;
+        move_list oppt_moves;
+        add_moves(copy, c == WHITE ? BLACK : WHITE, oppt_moves);
+        unmake_move(copy, u);
+        if (oppt_moves.length < min) {
+            options.length = 0;
+            options.moves[options.length ++] = candidate;
+            min = oppt_moves.length;
         }
-        else if (num_oppt_moves == min) {
-            options[num_options ++] = *candidate;
+        else if (oppt_moves.length == min) {
+            options.moves[options.length ++] = candidate;
         }
     }
-    return options[rand() % num_options];
-}
\ No newline at end of file
+    return options.moves[random_number() % options.length];
+}
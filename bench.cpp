@@ -0,0 +1,102 @@
+#include "chess.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+// Times the work that depends on the board layout: generating moves, making and
+// unmaking them, evaluating and rebuilding whole positions. 'make bench' builds
+// one binary per layout, all playing through the same positions.
+
+#define BENCH_GAMES 64
+#define BENCH_PLIES 80
+
+static double seconds_since(const timespec& start) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// random games from the initial setup, the same ones for every layout
+static uint32_t collect_positions(game* positions, color* sides) {
+    uint32_t length = 0;
+    seed_random(1);
+    for (uint8_t i = 0; i < BENCH_GAMES; i ++) {
+        game g;
+        setup_game(g);
+        color c = WHITE;
+        for (uint8_t ply = 0; ply < BENCH_PLIES; ply ++) {
+            move_list list;
+            add_moves(g, c, list);
+            if (!list.length) break;
+            positions[length] = g, sides[length ++] = c;
+            move_piece(g, list.moves[random_number() % list.length]);
+            c = c == WHITE ? BLACK : WHITE;
+        }
+    }
+    return length;
+}
+
+int main(int argc, char** argv) {
+    // bench [<rounds>]
+    int rounds = argc > 1 ? atoi(argv[1]) : 20;
+    if (argc > 2 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [<rounds>]\n", argv[0]);
+        return 1;
+    }
+
+    game* positions = (game*)malloc(BENCH_GAMES * BENCH_PLIES * sizeof(game));
+    color* sides = (color*)malloc(BENCH_GAMES * BENCH_PLIES * sizeof(color));
+    uint32_t length = collect_positions(positions, sides);
+    printf("Board layout: %s (%u bytes), %u positions, %d rounds\n", board_layout, unsigned(sizeof(board)), length, rounds);
+
+    uint64_t moves = 0;
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < rounds; r ++) {
+        for (uint32_t i = 0; i < length; i ++) {
+            move_list list;
+            add_moves(positions[i], sides[i], list);
+            moves += list.length;
+        }
+    }
+    double seconds = seconds_since(start);
+    printf("Generate: %10.0f moves/s\n", moves / seconds);
+
+    uint64_t made = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < rounds; r ++) {
+        for (uint32_t i = 0; i < length; i ++) {
+            move_list list;
+            add_moves(positions[i], sides[i], list);
+            for (uint16_t j = 0; j < list.length; j ++) {
+                undo u;
+                make_move(positions[i], list.moves[j], u);
+                unmake_move(positions[i], u);
+            }
+            made += list.length;
+        }
+    }
+    seconds = seconds_since(start);
+    printf("Make:     %10.0f moves/s (with generation)\n", made / seconds);
+
+    score total = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < rounds * 10; r ++) {
+        for (uint32_t i = 0; i < length; i ++) total += get_score(positions[i], sides[i]);
+    }
+    seconds = seconds_since(start);
+    printf("Evaluate: %10.0f positions/s\n", uint64_t(rounds) * 10 * length / seconds);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < rounds; r ++) {
+        for (uint32_t i = 0; i < length; i ++) update_game_state(positions[i]);
+    }
+    seconds = seconds_since(start);
+    printf("Rebuild:  %10.0f positions/s\n", uint64_t(rounds) * length / seconds);
+
+    printf("Checksum: %llu moves, %lld score\n", (unsigned long long)moves, (long long)total);
+    free(positions);
+    free(sides);
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef BOOK_H
+#define BOOK_H
+
+#include "chess.h"
+
+// An opening book in the Polyglot .bin layout: 16-byte big-endian entries of key, move,
+// weight and learn, sorted by key, the keys being polyglot_key()'s.
+struct opening_book {
+    const uint8_t* entries; // the mapped file, read in place
+    uint64_t length; // in entries
+    uint64_t bytes;
+};
+
+bool open_book(opening_book& b, const char* path); // closes the old book first, keeps it closed on failure
+void close_book(opening_book& b);
+// one of the book moves for the position, picked at random by weight, or INVALID_MOVE
+move probe_book(const opening_book& b, game& g, color c);
+
+uint64_t polyglot_key(const game& g, color c);
+uint16_t book_move(move m); // in Polyglot's encoding
+move from_book_move(game& g, color c, uint16_t bm); // INVALID_MOVE unless legal
+
+#endif
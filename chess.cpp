@@ -1,21 +1,79 @@
 #include "chess.h"
+#include "book.h"
+#include "nnue.h"
+#include "tablebase.h"
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
 #include <ctime>
+#include <pthread.h>
+#if defined(__BMI2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 const score piece_values[8] = {
     0, // empty
     0, 
     1, // pawn
-    4, // knight
+    3, // knight
     3, // bishop
-    3, // rook
-    10, // queen
+    5, // rook
+    9, // queen
     10, // king
 };
 
 
+#if defined(BITBOARD_BOARD)
+const char board_layout[] = "bitboards";
+
+void clear_board(board& b) {
+    for (uint8_t p = 0; p < 16; p ++) b.pieces[p] = 0;
+}
+
+void set_piece(board& b, int8_t x, int8_t y, piece p) {
+    pieces_set bit = 1ull << (y * 8 + x);
+    for (uint8_t i = WHITE_PAWN; i <= BLACK_KING; i ++) b.pieces[i] &= ~bit;
+    if (p) b.pieces[p] |= bit;
+}
+
+piece get_piece(const board& b, int8_t x, int8_t y) {
+    uint8_t sq = y * 8 + x;
+    for (uint8_t p = WHITE_PAWN; p <= BLACK_KING; p ++) if (b.pieces[p] >> sq & 1) return piece(p);
+    return EMPTY;
+}
+#elif defined(MAILBOX_BOARD)
+const char board_layout[] = "mailbox";
+
+void clear_board(board& b) {
+    for (uint8_t sq = 0; sq < 64; sq ++) b.squares[sq] = EMPTY;
+    for (uint8_t p = 0; p < 16; p ++) b.first[p] = NO_SQUARE;
+}
+
+void set_piece(board& b, int8_t x, int8_t y, piece p) {
+    uint8_t sq = y * 8 + x;
+    if (piece old = b.squares[sq]) { // unlink sq from the old piece's list
+        if (b.previous[sq] == NO_SQUARE) b.first[old] = b.next[sq];
+        else b.next[b.previous[sq]] = b.next[sq];
+        if (b.next[sq] != NO_SQUARE) b.previous[b.next[sq]] = b.previous[sq];
+    }
+    if (p) { // and put it at the front of the new one's
+        b.previous[sq] = NO_SQUARE, b.next[sq] = b.first[p];
+        if (b.first[p] != NO_SQUARE) b.previous[b.first[p]] = sq;
+        b.first[p] = sq;
+    }
+    b.squares[sq] = p;
+}
+
+piece get_piece(const board& b, int8_t x, int8_t y) {
+    return b.squares[y * 8 + x];
+}
+#else
+const char board_layout[] = "nibbles";
+
+void clear_board(board& b) {
+    for (uint8_t i = 0; i < 8; i ++) b.rows[i] = 0;
+}
+
 void set_piece(board& b, int8_t x, int8_t y, piece p) {
     b.rows[y] &= ~(15 << (4 * x));
     b.rows[y] |= p << (4 * x);
@@ -24,13 +82,14 @@ void set_piece(board& b, int8_t x, int8_t y, piece p) {
 piece get_piece(const board& b, int8_t x, int8_t y) {
     return piece(b.rows[y] >> (4 * x) & 15);
 }
+#endif
 
 piece make_piece(color c, kind k) {
     return piece(c | k);
 }
 
 kind get_kind(const board& b, int8_t x, int8_t y) {
-    return kind(b.rows[y] >> (4 * x) & 7);
+    return kind(get_piece(b, x, y) & 7);
 }
 
 kind get_kind(piece p) {
@@ -38,7 +97,7 @@ kind get_kind(piece p) {
 }
 
 color get_color(const board& b, int8_t x, int8_t y) {
-    return color(b.rows[y] >> (4 * x) & 8);
+    return color(get_piece(b, x, y) & 8);
 }
 
 color get_color(piece p) {
@@ -52,36 +111,30 @@ pos pos_of(int8_t x, int8_t y) {
     return { (uint8_t)x, (uint8_t)y, 0 };
 }
 
-const move INVALID_MOVE = { 7u, 7u, 7u, 7u, EMPTY }; // empty
+const move INVALID_MOVE = { 7u, 7u, 7u, 7u, 1u, 7u }; // all 1s
 
-move move_of(int8_t src_x, int8_t src_y, int8_t dst_x, int8_t dst_y, piece p) {
+move move_of(int8_t src_x, int8_t src_y, int8_t dst_x, int8_t dst_y, bool capture, uint8_t special) {
     if (dst_x < 0 || dst_x >= 8 || dst_y < 0 || dst_y >= 8) return INVALID_MOVE;
-    return { (uint8_t)src_x, (uint8_t)src_y, (uint8_t)dst_x, (uint8_t)dst_y, p };
+    return { uint16_t(src_x), uint16_t(src_y), uint16_t(dst_x), uint16_t(dst_y), capture, special };
 }
 
 bool is_castle(move m) {
-    // king moving more than one square
-    return get_kind(m.p) == KING && m.dst_x != m.src_x - 1 && m.dst_x != m.src_x + 1;
+    return m.special == CASTLING;
 }
 
 bool is_promotion(move m) {
-    // pawn moving to opposite row
-    return get_kind(m.p) == PAWN && m.dst_y == (get_color(m.p) == WHITE ? 7 : 0);
-}
-
-bool operator==(pos a, pos b) {
-    return a.x == b.x && a.y == b.y;
+    return m.special >= KNIGHT;
 }
 
-bool operator!=(pos a, pos b) {
-    return !(a == b);
+kind promoted_kind(move m) {
+    return is_promotion(m) ? kind(m.special) : INVALID_KIND;
 }
 
-bool operator==(move a, move b) {
-    return a.src_x == b.src_x && a.src_y == b.src_y && a.dst_x == b.dst_x && a.dst_y == b.dst_y && a.p == b.p;
+bool operator==(pos a, pos b) {
+    return a.x == b.x && a.y == b.y && a.extra == b.extra; // h8 only differs from INVALID_POS in extra
 }
 
-bool operator!=(move a, move b) {
+bool operator!=(pos a, pos b) {
     return !(a == b);
 }
 
@@ -95,115 +148,221 @@ void set_targeted(targets_set& v, int8_t x, int8_t y) {
     v |= 1ul << uint8_t(y * 8 + x);
 }
 
-static void threaten(pieces_set ps, targets_set& v, piece p, int8_t x, int8_t y) {
+// single-square bitboard, or 0 if off the board
+static constexpr targets_set square_bit(int x, int y) {
+    return x < 0 || x >= 8 || y < 0 || y >= 8 ? 0 : 1ull << (y * 8 + x);
+}
+
+static constexpr targets_set pawn_reach(int x, int y, int dy) {
+    return square_bit(x - 1, y + dy) | square_bit(x + 1, y + dy);
+}
+
+static constexpr targets_set white_pawn_reach(int x, int y) { return pawn_reach(x, y, 1); } // bottom-up
+static constexpr targets_set black_pawn_reach(int x, int y) { return pawn_reach(x, y, -1); } // top-down
+
+static constexpr targets_set knight_reach(int x, int y) {
+    return square_bit(x - 1, y - 2) | square_bit(x + 1, y - 2)
+        | square_bit(x - 1, y + 2) | square_bit(x + 1, y + 2)
+        | square_bit(x - 2, y - 1) | square_bit(x - 2, y + 1)
+        | square_bit(x + 2, y - 1) | square_bit(x + 2, y + 1);
+}
+
+static constexpr targets_set king_reach(int x, int y) {
+    return square_bit(x - 1, y - 1) | square_bit(x, y - 1) | square_bit(x + 1, y - 1)
+        | square_bit(x - 1, y)                              | square_bit(x + 1, y)
+        | square_bit(x - 1, y + 1) | square_bit(x, y + 1) | square_bit(x + 1, y + 1);
+}
+
+// expands to f(x, y) for all 64 squares, in square index order
+#define SQUARE_ROW(f, y) f(0, y), f(1, y), f(2, y), f(3, y), f(4, y), f(5, y), f(6, y), f(7, y)
+#define ALL_SQUARES(f) SQUARE_ROW(f, 0), SQUARE_ROW(f, 1), SQUARE_ROW(f, 2), SQUARE_ROW(f, 3), \
+    SQUARE_ROW(f, 4), SQUARE_ROW(f, 5), SQUARE_ROW(f, 6), SQUARE_ROW(f, 7)
+
+static constexpr targets_set pawn_table[2][64] = { { ALL_SQUARES(white_pawn_reach) }, { ALL_SQUARES(black_pawn_reach) } };
+static constexpr targets_set knight_table[64] = { ALL_SQUARES(knight_reach) };
+static constexpr targets_set king_table[64] = { ALL_SQUARES(king_reach) };
+
+#undef ALL_SQUARES
+#undef SQUARE_ROW
+
+// slider targets are looked up from the blockers on each square's rays (minus the board edges),
+// indexed by PEXT where BMI2 is available and by multiplying with a magic factor otherwise
+struct magic {
+    pieces_set mask;
+    uint64_t factor;
+    targets_set* table;
+    uint8_t shift;
+};
+
+static const uint64_t rook_factors[64] = {
+    0x1080004008801020ull, 0x0840092002c03000ull, 0x1900200010400900ull, 0x0880100008000480ull,
+    0x4200100420080200ull, 0x8100020100080400ull, 0x0200040110886200ull, 0x0200008040220411ull,
+    0x0404800084400220ull, 0x0000401000402000ull, 0x0086001081220440ull, 0x0408800800100280ull,
+    0x000a001201040820ull, 0x8848800200840080ull, 0x4001000100040200ull, 0x0442000102105084ull,
+    0x9080010020804100ull, 0x0040404000201009ull, 0x0000808010002009ull, 0x2200090021d00100ull,
+    0x0008008008040080ull, 0x0004004002010040ull, 0x0011040008015042ull, 0x00000a0001768104ull,
+    0x0000800080204009ull, 0x2010004140002001ull, 0x9800200280100080ull, 0x1000100080080080ull,
+    0x0442000a00049020ull, 0x2100040080020080ull, 0x0800120400900148ull, 0x0010040a00128541ull,
+    0x2800804000800030ull, 0x1010002000400041ull, 0x4000200011004100ull, 0x0610008410800800ull,
+    0x0400802402800800ull, 0xc100020080800400ull, 0x0002000802000401ull, 0x0182085882000401ull,
+    0x0220204000808000ull, 0x2860100040024022ull, 0x0001002004110040ull, 0x99101042000a0020ull,
+    0x0004080004008080ull, 0x0010040002008080ull, 0x2012004881020004ull, 0x8300842444820011ull,
+    0x0088403882010200ull, 0x0820400080210100ull, 0x0110910040a00300ull, 0x0801100280080480ull,
+    0x0242009008200600ull, 0x1002000489500200ull, 0x0040800200010080ull, 0x0091800041000080ull,
+    0x0000209300488001ull, 0x04c1002414824001ull, 0x020020000b001041ull, 0x7000100004200901ull,
+    0x8002002004100802ull, 0x30010002084c0007ull, 0x0888221800813004ull, 0x4000002840840112ull
+};
+
+static const uint64_t bishop_factors[64] = {
+    0xa010041108003100ull, 0x006082020a002900ull, 0x6810010619200000ull, 0x08281a0520000408ull,
+    0x0001104001000400ull, 0x0018901008048400ull, 0x00040a0210245280ull, 0x000200210808a402ull,
+    0x9140048410821200ull, 0x0800091010820041ull, 0x20504804832202c0ull, 0x0100091401081000ull,
+    0x8021011140000012ull, 0x0810020804450400ull, 0x208b0542109008a2ull, 0x0080084a08040204ull,
+    0x0040e2a80811244cull, 0x2505022008008108ull, 0x0430220100420040ull, 0x010a040420220040ull,
+    0x1105000290400000ull, 0x0093001200822120ull, 0x4000a62048043004ull, 0x280120048a015004ull,
+    0x006090002a020814ull, 0x44042000240800d0ull, 0x01102800040a4400ull, 0x1004080080220040ull,
+    0x0001001011004024ull, 0x0010044000805040ull, 0x0914041200820100ull, 0x0004821012821480ull,
+    0x0024040500c05021ull, 0x0088611002080200ull, 0x0116080a00040020ull, 0x4000020080080080ull,
+    0x2450450140840040ull, 0x0000880201484100ull, 0x0222020404020092ull, 0x8081110600002e00ull,
+    0x2842101105000801ull, 0x1100809008001025ull, 0x00020202221c0400ull, 0x0422014022009020ull,
+    0x0210046102100c00ull, 0xc004008082029102ull, 0x00aa461801101200ull, 0x0404080080201108ull,
+    0x020542108c205002ull, 0x0410544804100100ull, 0x0040910841100000ull, 0x0400200042021100ull,
+    0x00004204850400c0ull, 0x0200100410a42102ull, 0x1040020801210102ull, 0x0805040410420000ull,
+    0x2884804130100200ull, 0x800c262201242000ull, 0x1058000194108800ull, 0x0014221054420204ull,
+    0x0104000012a02200ull, 0x0200881003300100ull, 0x0140400202840100ull, 0x0402020801010201ull
+};
+
+static const int8_t rook_dirs[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+static const int8_t bishop_dirs[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+
+static magic rook_magics[64], bishop_magics[64];
+static targets_set slider_table[102400 + 5248]; // sum of 2^popcount(mask) over all rook and bishop squares
+
+static inline uint32_t magic_index(const magic& m, pieces_set ps) {
+#ifdef __BMI2__
+    return _pext_u64(ps, m.mask);
+#else
+    return ((ps & m.mask) * m.factor) >> m.shift;
+#endif
+}
+
+// walks each ray one square at a time, only used to fill the tables
+static targets_set slide(int8_t x, int8_t y, pieces_set ps, const int8_t (*dirs)[2]) {
+    targets_set v = 0;
+    for (uint8_t i = 0; i < 4; i ++) {
+        for (int8_t vx = x + dirs[i][0], vy = y + dirs[i][1]; vx >= 0 && vx < 8 && vy >= 0 && vy < 8; vx += dirs[i][0], vy += dirs[i][1]) {
+            set_targeted(v, vx, vy);
+            if (is_piece(ps, vx, vy)) break; // if piece there
+        }
+    }
+    return v;
+}
+
+static void init_magics(magic* magics, const uint64_t* factors, const int8_t (*dirs)[2], targets_set*& table) {
+    const pieces_set rank_edges = 0xff000000000000ffull, file_edges = 0x8181818181818181ull;
+    for (uint8_t sq = 0; sq < 64; sq ++) {
+        int8_t x = sq % 8, y = sq / 8;
+        pieces_set edges = (rank_edges & ~(0xffull << (y * 8))) | (file_edges & ~(0x0101010101010101ull << x));
+        magic& m = magics[sq];
+        m.mask = slide(x, y, 0, dirs) & ~edges;
+        m.factor = factors[sq];
+        m.shift = 64 - __builtin_popcountll(m.mask);
+        m.table = table;
+        table += 1ull << __builtin_popcountll(m.mask);
+
+        pieces_set blockers = 0;
+        do { // every subset of the mask
+            m.table[magic_index(m, blockers)] = slide(x, y, blockers, dirs);
+            blockers = (blockers - m.mask) & m.mask;
+        } while (blockers);
+    }
+}
+
+static targets_set between_table[64][64]; // squares strictly between two squares on a shared line
+
+static struct magic_init {
+    magic_init() {
+        targets_set* table = slider_table;
+        init_magics(rook_magics, rook_factors, rook_dirs, table);
+        init_magics(bishop_magics, bishop_factors, bishop_dirs, table);
+        for (uint8_t a = 0; a < 64; a ++) for (uint8_t b = 0; b < 64; b ++) {
+            pieces_set bit_a = 1ull << a, bit_b = 1ull << b;
+            if (rook_targets(a, 0) & bit_b) between_table[a][b] = rook_targets(a, bit_b) & rook_targets(b, bit_a);
+            else if (bishop_targets(a, 0) & bit_b) between_table[a][b] = bishop_targets(a, bit_b) & bishop_targets(b, bit_a);
+        }
+    }
+} magic_init_instance;
+
+// random keys xored together into game::key, one per piece and square (none for
+// EMPTY), one per combination of castling rights and one for black to move
+static uint64_t piece_keys[16][64];
+static uint64_t castle_keys[16];
+static uint64_t black_key;
+static uint64_t material_keys[16][16]; // game::material_key has [p][1] to [p][n] for n of p
+
+static struct key_init {
+    key_init() {
+        uint64_t state = 0x9e3779b97f4a7c15ull;
+        auto next = [&state]() { // splitmix64
+            uint64_t z = state += 0x9e3779b97f4a7c15ull;
+            z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ z >> 27) * 0x94d049bb133111ebull;
+            return z ^ z >> 31;
+        };
+        for (uint8_t p = 0; p < 16; p ++) for (uint8_t sq = 0; sq < 64; sq ++) piece_keys[p][sq] = get_kind(piece(p)) ? next() : 0;
+        uint64_t rights[4];
+        for (uint8_t i = 0; i < 4; i ++) rights[i] = next();
+        for (uint8_t i = 0; i < 16; i ++) {
+            castle_keys[i] = 0;
+            for (uint8_t j = 0; j < 4; j ++) if (i >> j & 1) castle_keys[i] ^= rights[j];
+        }
+        black_key = next();
+        for (uint8_t p = 0; p < 16; p ++) for (uint8_t n = 1; n < 16; n ++) material_keys[p][n] = get_kind(piece(p)) ? next() : 0;
+    }
+} key_init_instance;
+
+targets_set pawn_targets(color c, uint8_t sq) {
+    return pawn_table[c == BLACK][sq];
+}
+
+targets_set knight_targets(uint8_t sq) {
+    return knight_table[sq];
+}
+
+targets_set bishop_targets(uint8_t sq, pieces_set ps) {
+    return bishop_magics[sq].table[magic_index(bishop_magics[sq], ps)];
+}
+
+targets_set rook_targets(uint8_t sq, pieces_set ps) {
+    return rook_magics[sq].table[magic_index(rook_magics[sq], ps)];
+}
+
+targets_set queen_targets(uint8_t sq, pieces_set ps) {
+    return bishop_targets(sq, ps) | rook_targets(sq, ps);
+}
+
+targets_set king_targets(uint8_t sq) {
+    return king_table[sq];
+}
+
+targets_set piece_targets(piece p, uint8_t sq, pieces_set ps) {
     switch (get_kind(p)) {
-        case PAWN:
-            if (get_color(p) == BLACK) // top-down
-                set_targeted(v, x - 1, y - 1), set_targeted(v, x + 1, y - 1);
-            else // bottom-up
-                set_targeted(v, x - 1, y + 1), set_targeted(v, x + 1, y + 1);
-            return;
-        case KNIGHT:
-            set_targeted(v, x - 1, y - 2);
-            set_targeted(v, x + 1, y - 2);
-            set_targeted(v, x - 1, y + 2);
-            set_targeted(v, x + 1, y + 2);
-            set_targeted(v, x - 2, y - 1);
-            set_targeted(v, x - 2, y + 1);
-            set_targeted(v, x + 2, y - 1);
-            set_targeted(v, x + 2, y + 1);
-            return;
-        case BISHOP:
-            for (int8_t vx = x - 1, vy = y - 1; vx >= 0 && vy >= 0; vx --, vy --) { // upper left
-                set_targeted(v, vx, vy);
-                if (is_piece(ps, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x + 1, vy = y - 1; vx < 8 && vy >= 0; vx ++, vy --) { // upper right
-                set_targeted(v, vx, vy);
-                if (is_piece(ps, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x + 1, vy = y + 1; vx < 8 && vy < 8; vx ++, vy ++) { // lower right
-                set_targeted(v, vx, vy);
-                if (is_piece(ps, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x - 1, vy = y + 1; vx >= 0 && vy < 8; vx --, vy ++) { // lower left
-                set_targeted(v, vx, vy);
-                if (is_piece(ps, vx, vy)) break; // if piece there
-            }
-            return;
-        case ROOK:
-            for (int8_t vx = x - 1; vx >= 0; vx --) {
-                set_targeted(v, vx, y);
-                if (is_piece(ps, vx, y)) break; // if piece there
-            }
-            for (int8_t vx = x + 1; vx < 8; vx ++) {
-                set_targeted(v, vx, y);
-                if (is_piece(ps, vx, y)) break; // if piece there
-            }
-            for (int8_t vy = y - 1; vy >= 0; vy --) {
-                set_targeted(v, x, vy);
-                if (is_piece(ps, x, vy)) break; // if piece there
-            }
-            for (int8_t vy = y + 1; vy < 8; vy ++) {
-                set_targeted(v, x, vy);
-                if (is_piece(ps, x, vy)) break; // if piece there
-            }
-            return;
-        case QUEEN:
-            for (int8_t vx = x - 1, vy = y - 1; vx >= 0 && vy >= 0; vx --, vy --) { // upper left
-                set_targeted(v, vx, vy);
-                if (is_piece(ps, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x + 1, vy = y - 1; vx < 8 && vy >= 0; vx ++, vy --) { // upper right
-                set_targeted(v, vx, vy);
-                if (is_piece(ps, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x + 1, vy = y + 1; vx < 8 && vy < 8; vx ++, vy ++) { // lower right
-                set_targeted(v, vx, vy);
-                if (is_piece(ps, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x - 1, vy = y + 1; vx >= 0 && vy < 8; vx --, vy ++) { // lower left
-                set_targeted(v, vx, vy);
-                if (is_piece(ps, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x - 1; vx >= 0; vx --) {
-                set_targeted(v, vx, y);
-                if (is_piece(ps, vx, y)) break; // if piece there
-            }
-            for (int8_t vx = x + 1; vx < 8; vx ++) {
-                set_targeted(v, vx, y);
-                if (is_piece(ps, vx, y)) break; // if piece there
-            }
-            for (int8_t vy = y - 1; vy >= 0; vy --) {
-                set_targeted(v, x, vy);
-                if (is_piece(ps, x, vy)) break; // if piece there
-            }
-            for (int8_t vy = y + 1; vy < 8; vy ++) {
-                set_targeted(v, x, vy);
-                if (is_piece(ps, x, vy)) break; // if piece there
-            }
-            return;
-        case KING:
-            set_targeted(v, x - 1, y - 1); // these lines look like a crown :3
-            set_targeted(v, x, y - 1);
-            set_targeted(v, x + 1, y - 1);
-            set_targeted(v, x - 1, y);
-            set_targeted(v, x + 1, y);
-            set_targeted(v, x - 1, y + 1);
-            set_targeted(v, x, y + 1);
-            set_targeted(v, x + 1, y + 1);
-            return;
-        default: return;
+        case PAWN: return pawn_targets(get_color(p), sq);
+        case KNIGHT: return knight_targets(sq);
+        case BISHOP: return bishop_targets(sq, ps);
+        case ROOK: return rook_targets(sq, ps);
+        case QUEEN: return queen_targets(sq, ps);
+        case KING: return king_targets(sq);
+        default: return 0;
     }
 }
 
 targets_set find_targeted(const board& b, pieces_set ps, color c) {
     targets_set v = 0;
-    for (int8_t x = 0; x < 8; x ++) {
-        for (int8_t y = 0; y < 8; y ++) {
-            piece p = get_piece(b, x, y);
-            if (get_color(p) == c) threaten(ps, v, p, x, y);
-        }
+    for (pieces_set rest = ps; rest; rest &= rest - 1) {
+        uint8_t sq = __builtin_ctzll(rest);
+        piece p = get_piece(b, sq % 8, sq / 8);
+        if (get_color(p) == c) v |= piece_targets(p, sq, ps);
     }
     return v;
 }
@@ -223,235 +382,951 @@ void remove_piece(pieces_set& v, int8_t x, int8_t y) {
     v &= ~(1ul << (y * 8 + x));
 }
 
+#if defined(BITBOARD_BOARD)
+void find_sets(const board& b, board_sets& sets) {
+    sets.white = sets.black = 0;
+    for (uint8_t k = PAWN; k <= KING; k ++) {
+        sets.white |= b.pieces[WHITE | k], sets.black |= b.pieces[BLACK | k];
+        sets.kinds[k] = b.pieces[WHITE | k] | b.pieces[BLACK | k];
+    }
+    sets.kinds[INVALID_KIND] = ~(sets.white | sets.black), sets.kinds[1] = 0;
+}
+#elif defined(MAILBOX_BOARD)
+void find_sets(const board& b, board_sets& sets) {
+    for (uint8_t k = 0; k < 8; k ++) sets.kinds[k] = 0;
+    sets.white = sets.black = 0;
+    for (uint8_t p = WHITE_PAWN; p <= BLACK_KING; p ++) {
+        pieces_set v = 0;
+        for (uint8_t sq = b.first[p]; sq != NO_SQUARE; sq = b.next[sq]) v |= 1ull << sq;
+        (get_color(piece(p)) == WHITE ? sets.white : sets.black) |= v;
+        sets.kinds[get_kind(piece(p))] |= v;
+    }
+    sets.kinds[INVALID_KIND] = ~(sets.white | sets.black);
+}
+#else
+// Splits the nibbles into four bitboards, planes[i] holding bit i of every square. The kinds
+// and colors are then a few boolean operations on whole boards, rather than 64 lookups.
+#ifdef __SSE2__
+static void find_planes(const board& b, pieces_set* planes) {
+    // spread the nibbles out to a byte per square, a1 first: even files are the low nibbles
+    const __m128i nibble = _mm_set1_epi8(15);
+    __m128i s[4];
+    for (uint8_t i = 0; i < 2; i ++) {
+        __m128i rows = _mm_loadu_si128((const __m128i*)b.rows + i);
+        __m128i even = _mm_and_si128(rows, nibble), odd = _mm_and_si128(_mm_srli_epi16(rows, 4), nibble);
+        s[2 * i] = _mm_unpacklo_epi8(even, odd), s[2 * i + 1] = _mm_unpackhi_epi8(even, odd);
+    }
+    // movemask takes the top bit of each byte, so shift the wanted bit up there
+    for (uint8_t i = 0; i < 4; i ++) {
+        planes[i] = uint16_t(_mm_movemask_epi8(_mm_slli_epi16(s[0], 7 - i)))
+            | uint64_t(uint16_t(_mm_movemask_epi8(_mm_slli_epi16(s[1], 7 - i)))) << 16
+            | uint64_t(uint16_t(_mm_movemask_epi8(_mm_slli_epi16(s[2], 7 - i)))) << 32
+            | uint64_t(uint16_t(_mm_movemask_epi8(_mm_slli_epi16(s[3], 7 - i)))) << 48;
+    }
+}
+#else
+// gathers the lowest bit of each nibble in v into the low 16 bits
+static inline uint64_t nibble_bits(uint64_t v) {
+#ifdef __BMI2__
+    return _pext_u64(v, 0x1111111111111111ull);
+#else
+    v &= 0x1111111111111111ull;
+    v = (v | v >> 3) & 0x0303030303030303ull;
+    v = (v | v >> 6) & 0x000f000f000f000full;
+    v = (v | v >> 12) & 0x000000ff000000ffull;
+    return (v | v >> 24) & 0xffff;
+#endif
+}
+
+static void find_planes(const board& b, pieces_set* planes) {
+    for (uint8_t i = 0; i < 4; i ++) planes[i] = 0;
+    for (uint8_t y = 0; y < 8; y += 2) { // two rows, 16 squares, at a time
+        uint64_t v = b.rows[y] | uint64_t(b.rows[y + 1]) << 32;
+        for (uint8_t i = 0; i < 4; i ++) planes[i] |= nibble_bits(v >> i) << 8 * y;
+    }
+}
+#endif
+
+void find_sets(const board& b, board_sets& sets) {
+    pieces_set planes[4];
+    find_planes(b, planes);
+    pieces_set occupied = planes[0] | planes[1] | planes[2];
+    sets.white = occupied & ~planes[3], sets.black = occupied & planes[3];
+    for (uint8_t k = 0; k < 8; k ++) {
+        sets.kinds[k] = (k & 1 ? planes[0] : ~planes[0]) & (k & 2 ? planes[1] : ~planes[1]) & (k & 4 ? planes[2] : ~planes[2]);
+    }
+}
+#endif
+
 pieces_set find_pieces(const board& b, color c) {
-    pieces_set v = 0;
-    for (int8_t x = 0; x < 8; x ++) {
-        for (int8_t y = 0; y < 8; y ++) {
-            if (get_color(b, x, y) == c && get_piece(b, x, y)) set_piece(v, x, y);
-        }
+    board_sets sets;
+    find_sets(b, sets);
+    return c == WHITE ? sets.white : sets.black;
+}
+
+pieces_set find_king(const board& b, color c) {
+    board_sets sets;
+    find_sets(b, sets);
+    return sets.kinds[KING] & (c == WHITE ? sets.white : sets.black);
+}
+
+// bitboard of the given kind that p belongs to, or null for empty/invalid pieces
+static pieces_set* kind_set(game& g, piece p) {
+    switch (get_kind(p)) {
+        case PAWN: return &g.pawns;
+        case KNIGHT: return &g.knights;
+        case BISHOP: return &g.bishops;
+        case ROOK: return &g.rooks;
+        case QUEEN: return &g.queens;
+        case KING: return get_color(p) == WHITE ? &g.white_king : &g.black_king;
+        default: return nullptr;
+    }
+}
+
+static uint8_t piece_count(game& g, piece p) {
+    return __builtin_popcountll(*kind_set(g, p) & (get_color(p) == WHITE ? g.white_pieces : g.black_pieces)) & 15;
+}
+
+// replaces whatever is on (x, y) with p, keeping the piece bitboards and keys in sync
+static void put_piece(game& g, int8_t x, int8_t y, piece p) {
+    pieces_set bit = 1ull << (y * 8 + x);
+    piece old = get_piece(g.b, x, y);
+    if (old) {
+        g.material_key ^= material_keys[old][piece_count(g, old)];
+        (get_color(old) == WHITE ? g.white_pieces : g.black_pieces) &= ~bit;
+        if (pieces_set* kinds = kind_set(g, old)) *kinds &= ~bit;
+    }
+    if (p) {
+        (get_color(p) == WHITE ? g.white_pieces : g.black_pieces) |= bit;
+        if (pieces_set* kinds = kind_set(g, p)) *kinds |= bit;
+        g.material_key ^= material_keys[p][piece_count(g, p)];
     }
+    g.pieces = g.white_pieces | g.black_pieces;
+    g.key ^= piece_keys[old][y * 8 + x] ^ piece_keys[p][y * 8 + x];
+    if (get_kind(old) == PAWN) g.pawn_key ^= piece_keys[old][y * 8 + x];
+    if (get_kind(p) == PAWN) g.pawn_key ^= piece_keys[p][y * 8 + x];
+    set_piece(g.b, x, y, p);
+}
+
+static uint8_t castle_rights(const game& g) {
+    return g.white_left_castle | g.white_right_castle << 1 | g.black_left_castle << 2 | g.black_right_castle << 3;
+}
+
+uint64_t game_key(const game& g, color c) {
+    return c == BLACK ? g.key ^ black_key : g.key;
+}
+
+// What differs between the two sides, so the generators below can be written once and
+// specialized on the color, with no runtime branches on it left inside their loops.
+template <color C> struct side;
+
+template <> struct side<WHITE> {
+    static constexpr color enemy = BLACK;
+    static constexpr int8_t forward = 8; // bottom-up
+    static constexpr uint8_t back_row = 0;
+    static constexpr targets_set push_row = 0xff0000ull; // reached by a first push that can go on
+    static constexpr targets_set last_row = 0xff00000000000000ull;
+    static pieces_set own(const game& g) { return g.white_pieces; }
+    static pieces_set king(const game& g) { return g.white_king; }
+    static bool in_check(const game& g) { return g.white_in_check; }
+    static bool left_castle(const game& g) { return g.white_left_castle; }
+    static bool right_castle(const game& g) { return g.white_right_castle; }
+    static targets_set slider_targets(const game& g) { return g.white_slider_targets; }
+    static targets_set targets(const game& g) { return g.white_targets; }
+};
+
+template <> struct side<BLACK> {
+    static constexpr color enemy = WHITE;
+    static constexpr int8_t forward = -8; // top-down
+    static constexpr uint8_t back_row = 7;
+    static constexpr targets_set push_row = 0xff0000000000ull;
+    static constexpr targets_set last_row = 0xffull;
+    static pieces_set own(const game& g) { return g.black_pieces; }
+    static pieces_set king(const game& g) { return g.black_king; }
+    static bool in_check(const game& g) { return g.black_in_check; }
+    static bool left_castle(const game& g) { return g.black_left_castle; }
+    static bool right_castle(const game& g) { return g.black_right_castle; }
+    static targets_set slider_targets(const game& g) { return g.black_slider_targets; }
+    static targets_set targets(const game& g) { return g.black_targets; }
+};
+
+static const pieces_set file_a = 0x0101010101010101ull, file_h = 0x8080808080808080ull;
+
+// moves every square by a compile-time step, which may be negative
+template <int8_t D> static inline targets_set shift(targets_set v) {
+    return D > 0 ? v << (D & 63) : v >> (-D & 63);
+}
+
+// squares attacked by all the pawns in ps
+template <color C> static inline targets_set pawn_attacks(pieces_set ps) {
+    return shift<side<C>::forward - 1>(ps & ~file_a) | shift<side<C>::forward + 1>(ps & ~file_h);
+}
+
+template <kind K> static inline targets_set attacks(uint8_t sq, pieces_set ps);
+template <> inline targets_set attacks<KNIGHT>(uint8_t sq, pieces_set) { return knight_table[sq]; }
+template <> inline targets_set attacks<BISHOP>(uint8_t sq, pieces_set ps) { return bishop_targets(sq, ps); }
+template <> inline targets_set attacks<ROOK>(uint8_t sq, pieces_set ps) { return rook_targets(sq, ps); }
+template <> inline targets_set attacks<QUEEN>(uint8_t sq, pieces_set ps) { return bishop_targets(sq, ps) | rook_targets(sq, ps); }
+template <> inline targets_set attacks<KING>(uint8_t sq, pieces_set) { return king_table[sq]; }
+
+template <color C> static inline pieces_set find_sliders(const game& g) {
+    return (g.bishops | g.rooks | g.queens) & side<C>::own(g);
+}
+
+template <color C> static targets_set find_slider_targets(const game& g, pieces_set ps) {
+    pieces_set own = side<C>::own(g);
+    targets_set v = 0;
+    for (pieces_set rest = (g.bishops | g.queens) & own; rest; rest &= rest - 1)
+        v |= bishop_targets(__builtin_ctzll(rest), ps);
+    for (pieces_set rest = (g.rooks | g.queens) & own; rest; rest &= rest - 1)
+        v |= rook_targets(__builtin_ctzll(rest), ps);
     return v;
 }
 
-pieces_set find_king(const board& b, color c) {
-    pieces_set v = 0;
-    for (int8_t x = 0; x < 8; x ++) {
-        for (int8_t y = 0; y < 8; y ++) {
-            piece p = get_piece(b, x, y);
-            if (get_color(p) == c && get_kind(p) == KING) set_piece(v, x, y);
+static targets_set find_slider_targets(const game& g, color c, pieces_set ps) {
+    return c == WHITE ? find_slider_targets<WHITE>(g, ps) : find_slider_targets<BLACK>(g, ps);
+}
+
+pieces_set attackers_to(const game& g, uint8_t sq, pieces_set ps) {
+    return (pawn_targets(BLACK, sq) & g.pawns & g.white_pieces) // white pawns attack upwards
+        | (pawn_targets(WHITE, sq) & g.pawns & g.black_pieces)
+        | (knight_targets(sq) & g.knights)
+        | (bishop_targets(sq, ps) & (g.bishops | g.queens))
+        | (rook_targets(sq, ps) & (g.rooks | g.queens))
+        | (king_targets(sq) & (g.white_king | g.black_king));
+}
+
+score static_exchange(const game& g, move m) {
+    uint8_t to = m.dst_y * 8 + m.dst_x;
+    kind mover = get_kind(g.b, m.src_x, m.src_y);
+    score gains[32];
+    gains[0] = piece_values[get_kind(g.b, m.dst_x, m.dst_y)];
+    kind target = mover; // what the next capture on the square takes
+    if (is_promotion(m)) target = promoted_kind(m), gains[0] += piece_values[target] - piece_values[PAWN];
+    pieces_set occupied = g.pieces & ~(1ull << (m.src_y * 8 + m.src_x));
+    color side = get_color(g.b, m.src_x, m.src_y) == WHITE ? BLACK : WHITE;
+    const pieces_set* kinds[] = { &g.pawns, &g.knights, &g.bishops, &g.rooks, &g.queens };
+
+    uint8_t depth = 0;
+    while (depth < 31) {
+        // pieces drop out of occupied as they capture, so the sliders behind them join in
+        pieces_set attackers = attackers_to(g, to, occupied) & occupied;
+        pieces_set own = attackers & (side == WHITE ? g.white_pieces : g.black_pieces);
+        if (!own) break;
+        pieces_set from = 0;
+        kind k = KING;
+        for (uint8_t i = 0; i < 5 && !from; i ++) {
+            if (pieces_set candidates = own & *kinds[i]) from = candidates & -candidates, k = kind(PAWN + i);
         }
+        if (!from) {
+            from = own & (g.white_king | g.black_king);
+            if (attackers & ~own) break; // the king can't capture into check
+        }
+        depth ++;
+        gains[depth] = piece_values[target] - gains[depth - 1];
+        target = k;
+        occupied &= ~from;
+        side = side == WHITE ? BLACK : WHITE;
+    }
+    // either side can stop capturing whenever carrying on would lose more
+    for (; depth > 0; depth --) {
+        if (-gains[depth] < gains[depth - 1]) gains[depth - 1] = -gains[depth];
     }
+    return gains[0];
+}
+
+// pawns, knights and king: cheap enough to redo from the bitboards every move
+template <color C> static targets_set find_leaper_targets(const game& g) {
+    pieces_set own = side<C>::own(g);
+    targets_set v = pawn_attacks<C>(g.pawns & own);
+    for (pieces_set rest = g.knights & own; rest; rest &= rest - 1)
+        v |= knight_table[__builtin_ctzll(rest)];
+    for (pieces_set rest = side<C>::king(g); rest; rest &= rest - 1)
+        v |= king_table[__builtin_ctzll(rest)];
     return v;
 }
 
-void move_piece(game& g, move m) {
-    piece p = m.p;
-    set_piece(g.b, m.src_x, m.src_y, EMPTY);
-    set_piece(g.b, m.dst_x, m.dst_y, p);
+// Recomputes targets and check flags after the squares in changed were modified. A color's
+// slider targets only need redoing if a changed square is on one of its rays (rays end on
+// their blocker) or holds one of its sliders from before or after the change.
+static void update_targets(game& g, pieces_set changed, pieces_set white_sliders, pieces_set black_sliders) {
+    if (changed & (g.white_slider_targets | white_sliders)) g.white_slider_targets = find_slider_targets<WHITE>(g, g.pieces);
+    if (changed & (g.black_slider_targets | black_sliders)) g.black_slider_targets = find_slider_targets<BLACK>(g, g.pieces);
+    g.white_targets = g.white_slider_targets | find_leaper_targets<WHITE>(g);
+    g.black_targets = g.black_slider_targets | find_leaper_targets<BLACK>(g);
+    g.white_in_check = g.white_king & g.black_targets;
+    g.black_in_check = g.black_king & g.white_targets;
+}
+
+void make_move(game& g, move m, undo& u) {
+    u.m = m;
+    u.moved = get_piece(g.b, m.src_x, m.src_y), u.captured = get_piece(g.b, m.dst_x, m.dst_y);
+    piece p = is_promotion(m) ? make_piece(get_color(u.moved), promoted_kind(m)) : u.moved;
+    u.white_targets = g.white_targets, u.black_targets = g.black_targets;
+    u.white_slider_targets = g.white_slider_targets, u.black_slider_targets = g.black_slider_targets;
+    u.white_in_check = g.white_in_check, u.black_in_check = g.black_in_check;
+    u.white_left_castle = g.white_left_castle, u.white_right_castle = g.white_right_castle;
+    u.black_left_castle = g.black_left_castle, u.black_right_castle = g.black_right_castle;
+    u.key = g.key;
+    u.halfmove_clock = g.halfmove_clock, u.fullmove_number = g.fullmove_number;
+    g.halfmove_clock = get_kind(u.moved) == PAWN || u.captured ? 0 : g.halfmove_clock + 1;
+    if (get_color(p) == BLACK) g.fullmove_number ++;
+
+    pieces_set white_sliders = find_sliders<WHITE>(g), black_sliders = find_sliders<BLACK>(g);
+    pieces_set changed = 1ull << (m.src_y * 8 + m.src_x) | 1ull << (m.dst_y * 8 + m.dst_x);
+    put_piece(g, m.src_x, m.src_y, EMPTY);
+    put_piece(g, m.dst_x, m.dst_y, p);
 
     if (get_kind(p) == ROOK) {
         if (m.src_x == 0)
-            get_color(p) == BLACK ? g.black_left_castle : g.white_left_castle = false;
+            (get_color(p) == BLACK ? g.black_left_castle : g.white_left_castle) = false;
         if (m.src_x == 7)
-            get_color(p) == BLACK ? g.black_right_castle : g.white_right_castle = false;
+            (get_color(p) == BLACK ? g.black_right_castle : g.white_right_castle) = false;
     }
     if (get_kind(p) == KING) {
-        get_color(p) == BLACK ? g.black_left_castle : g.white_left_castle = false;
-        get_color(p) == BLACK ? g.black_right_castle : g.white_right_castle = false;
+        (get_color(p) == BLACK ? g.black_left_castle : g.white_left_castle) = false;
+        (get_color(p) == BLACK ? g.black_right_castle : g.white_right_castle) = false;
+    }
+    if (m.dst_y == 0 || m.dst_y == 7) { // rook captured in its corner
+        bool& left_castle = m.dst_y == 0 ? g.white_left_castle : g.black_left_castle;
+        bool& right_castle = m.dst_y == 0 ? g.white_right_castle : g.black_right_castle;
+        if (m.dst_x == 0) left_castle = false;
+        if (m.dst_x == 7) right_castle = false;
     }
     if (is_castle(m)) { // move rooks
-        if (m.dst_x < m.src_x) // queenside
-            move_piece(g, { 0, m.dst_y, 3, m.dst_y, get_piece(g.b, 0, m.dst_y) });
-        if (m.dst_x > m.src_x) // kingside
-            move_piece(g, { 7, m.dst_y, 5, m.dst_y, get_piece(g.b, 7, m.dst_y) });
+        int8_t rook_src = -1, rook_dst = -1;
+        if (m.dst_x < m.src_x) rook_src = 0, rook_dst = 3; // queenside
+        if (m.dst_x > m.src_x) rook_src = 7, rook_dst = 5; // kingside
+        if (rook_src >= 0) {
+            u.rook_moved = get_piece(g.b, rook_src, m.dst_y), u.rook_captured = get_piece(g.b, rook_dst, m.dst_y);
+            put_piece(g, rook_dst, m.dst_y, u.rook_moved);
+            put_piece(g, rook_src, m.dst_y, EMPTY);
+            changed |= 1ull << (m.dst_y * 8 + rook_src) | 1ull << (m.dst_y * 8 + rook_dst);
+        }
     }
-    update_game_state(g);
+    g.key ^= castle_keys[castle_rights(g) ^ (u.white_left_castle | u.white_right_castle << 1 | u.black_left_castle << 2 | u.black_right_castle << 3)];
+    update_targets(g, changed, white_sliders | find_sliders<WHITE>(g), black_sliders | find_sliders<BLACK>(g));
 }
 
-void add_move(move* moves, uint8_t& length, move m) {
-    if (m != INVALID_MOVE) moves[length ++] = m;
+void unmake_move(game& g, const undo& u) {
+    move m = u.m;
+    if (is_castle(m)) { // move rooks back
+        int8_t rook_src = -1, rook_dst = -1;
+        if (m.dst_x < m.src_x) rook_src = 0, rook_dst = 3; // queenside
+        if (m.dst_x > m.src_x) rook_src = 7, rook_dst = 5; // kingside
+        if (rook_src >= 0) {
+            put_piece(g, rook_dst, m.dst_y, u.rook_captured);
+            put_piece(g, rook_src, m.dst_y, u.rook_moved);
+        }
+    }
+    put_piece(g, m.dst_x, m.dst_y, u.captured);
+    put_piece(g, m.src_x, m.src_y, u.moved);
+
+    g.white_targets = u.white_targets, g.black_targets = u.black_targets;
+    g.white_slider_targets = u.white_slider_targets, g.black_slider_targets = u.black_slider_targets;
+    g.white_in_check = u.white_in_check, g.black_in_check = u.black_in_check;
+    g.white_left_castle = u.white_left_castle, g.white_right_castle = u.white_right_castle;
+    g.black_left_castle = u.black_left_castle, g.black_right_castle = u.black_right_castle;
+    g.key = u.key;
+    g.halfmove_clock = u.halfmove_clock, g.fullmove_number = u.fullmove_number;
 }
 
-void try_promotion(move* moves, uint8_t& length, move m) {
-    uint8_t limit = get_color(m.p) == WHITE ? 7 : 0;
-    if (m.dst_y == limit) {
-        for (uint8_t k = uint8_t(KNIGHT); k < uint8_t(KING); k ++) {
-            move n = m;
-            n.p = make_piece(get_color(m.p), kind(k));
-            add_move(moves, length, n);
+void move_piece(game& g, move m) {
+    undo u;
+    make_move(g, m, u);
+}
+
+// adds a move from sq to each square in the reach set, a capture where that square is occupied
+static void add_targets(move_list& list, uint8_t sq, targets_set reach, pieces_set occupied) {
+    for (; reach; reach &= reach - 1) {
+        uint8_t to = __builtin_ctzll(reach);
+        list.moves[list.length ++] = { uint16_t(sq % 8), uint16_t(sq / 8), uint16_t(to % 8), uint16_t(to / 8), uint16_t(occupied >> to & 1), NORMAL_MOVE };
+    }
+}
+
+// adds a move from sq - D to each square in reach, in all four promotions on the last row
+template <color C, int8_t D> static inline void add_pawn_targets(move_list& list, targets_set reach) {
+    const bool capture = D != side<C>::forward && D != 2 * side<C>::forward;
+    for (; reach; reach &= reach - 1) {
+        uint8_t sq = __builtin_ctzll(reach), from = sq - D;
+        move m = { uint16_t(from % 8), uint16_t(from / 8), uint16_t(sq % 8), uint16_t(sq / 8), capture, NORMAL_MOVE };
+        if (!(side<C>::last_row >> sq & 1)) list.moves[list.length ++] = m;
+        else for (uint8_t k = KNIGHT; k < KING; k ++) {
+            m.special = k;
+            list.moves[list.length ++] = m;
         }
     }
-    else add_move(moves, length, m);
 }
 
-void add_moves(const game& g, color c, int8_t x, int8_t y, move* moves, uint8_t& length) {
-    pieces_set enemies = c == WHITE ? g.black_pieces : g.white_pieces; 
-    pieces_set allies = c == WHITE ? g.white_pieces : g.black_pieces;
-    piece p = get_piece(g.b, x, y);
-    switch (get_kind(p)) {
-        case PAWN:
-            if (c == WHITE) {
-                if (!is_piece(g.pieces, x, y + 1)) {
-                    try_promotion(moves, length, move_of(x, y, x, y + 1, p));
-                    if (y == 1 && !is_piece(g.pieces, x, y + 2)) // white starting line
-                        add_move(moves, length, move_of(x, y, x, y + 2, p));
-                }
-                if (is_piece(enemies, x - 1, y + 1)) try_promotion(moves, length, move_of(x, y, x - 1, y + 1, p));
-                if (is_piece(enemies, x + 1, y + 1)) try_promotion(moves, length, move_of(x, y, x + 1, y + 1, p));
-            }
-            else {
-                if (!is_piece(g.pieces, x, y - 1)) {
-                    try_promotion(moves, length, move_of(x, y, x, y - 1, p));
-                    if (y == 6 && !is_piece(g.pieces, x, y - 2)) // black starting line 
-                        add_move(moves, length, move_of(x, y, x, y - 2, p));
-                }
-                if (is_piece(enemies, x - 1, y - 1)) try_promotion(moves, length, move_of(x, y, x - 1, y - 1, p));
-                if (is_piece(enemies, x + 1, y - 1)) try_promotion(moves, length, move_of(x, y, x + 1, y - 1, p));
-            }
-            return;
-        case KNIGHT:
-            if (!is_piece(allies, x - 1, y - 2)) add_move(moves, length, move_of(x, y, x - 1, y - 2, p));
-            if (!is_piece(allies, x + 1, y - 2)) add_move(moves, length, move_of(x, y, x + 1, y - 2, p));
-            if (!is_piece(allies, x - 1, y + 2)) add_move(moves, length, move_of(x, y, x - 1, y + 2, p));
-            if (!is_piece(allies, x + 1, y + 2)) add_move(moves, length, move_of(x, y, x + 1, y + 2, p));
-            if (!is_piece(allies, x - 2, y - 1)) add_move(moves, length, move_of(x, y, x - 2, y - 1, p));
-            if (!is_piece(allies, x - 2, y + 1)) add_move(moves, length, move_of(x, y, x - 2, y + 1, p));
-            if (!is_piece(allies, x + 2, y - 1)) add_move(moves, length, move_of(x, y, x + 2, y - 1, p));
-            if (!is_piece(allies, x + 2, y + 1)) add_move(moves, length, move_of(x, y, x + 2, y + 1, p));
-            return;
-        case BISHOP:
-            for (int8_t vx = x - 1, vy = y - 1; vx >= 0 && vy >= 0; vx --, vy --) { // upper left
-                if (!is_piece(allies, vx, vy)) add_move(moves, length, move_of(x, y, vx, vy, p));
-                if (is_piece(g.pieces, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x + 1, vy = y - 1; vx < 8 && vy >= 0; vx ++, vy --) { // upper right
-                if (!is_piece(allies, vx, vy)) add_move(moves, length, move_of(x, y, vx, vy, p));
-                if (is_piece(g.pieces, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x + 1, vy = y + 1; vx < 8 && vy < 8; vx ++, vy ++) { // lower right
-                if (!is_piece(allies, vx, vy)) add_move(moves, length, move_of(x, y, vx, vy, p));
-                if (is_piece(g.pieces, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x - 1, vy = y + 1; vx >= 0 && vy < 8; vx --, vy ++) { // lower left
-                if (!is_piece(allies, vx, vy)) add_move(moves, length, move_of(x, y, vx, vy, p));
-                if (is_piece(g.pieces, vx, vy)) break; // if piece there
-            }
-            return;
-        case ROOK:
-            for (int8_t vx = x - 1; vx >= 0; vx --) {
-                if (!is_piece(allies, vx, y)) add_move(moves, length, move_of(x, y, vx, y, p));
-                if (is_piece(g.pieces, vx, y)) break; // if piece there
-            }
-            for (int8_t vx = x + 1; vx < 8; vx ++) {
-                if (!is_piece(allies, vx, y)) add_move(moves, length, move_of(x, y, vx, y, p));
-                if (is_piece(g.pieces, vx, y)) break; // if piece there
-            }
-            for (int8_t vy = y - 1; vy >= 0; vy --) {
-                if (!is_piece(allies, x, vy)) add_move(moves, length, move_of(x, y, x, vy, p));
-                if (is_piece(g.pieces, x, vy)) break; // if piece there
-            }
-            for (int8_t vy = y + 1; vy < 8; vy ++) {
-                if (!is_piece(allies, x, vy)) add_move(moves, length, move_of(x, y, x, vy, p));
-                if (is_piece(g.pieces, x, vy)) break; // if piece there
-            }
-            return;
-        case QUEEN:
-            for (int8_t vx = x - 1, vy = y - 1; vx >= 0 && vy >= 0; vx --, vy --) { // upper left
-                if (!is_piece(allies, vx, vy)) add_move(moves, length, move_of(x, y, vx, vy, p));
-                if (is_piece(g.pieces, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x + 1, vy = y - 1; vx < 8 && vy >= 0; vx ++, vy --) { // upper right
-                if (!is_piece(allies, vx, vy)) add_move(moves, length, move_of(x, y, vx, vy, p));
-                if (is_piece(g.pieces, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x + 1, vy = y + 1; vx < 8 && vy < 8; vx ++, vy ++) { // lower right
-                if (!is_piece(allies, vx, vy)) add_move(moves, length, move_of(x, y, vx, vy, p));
-                if (is_piece(g.pieces, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x - 1, vy = y + 1; vx >= 0 && vy < 8; vx --, vy ++) { // lower left
-                if (!is_piece(allies, vx, vy)) add_move(moves, length, move_of(x, y, vx, vy, p));
-                if (is_piece(g.pieces, vx, vy)) break; // if piece there
-            }
-            for (int8_t vx = x - 1; vx >= 0; vx --) {
-                if (!is_piece(allies, vx, y)) add_move(moves, length, move_of(x, y, vx, y, p));
-                if (is_piece(g.pieces, vx, y)) break; // if piece there
-            }
-            for (int8_t vx = x + 1; vx < 8; vx ++) {
-                if (!is_piece(allies, vx, y)) add_move(moves, length, move_of(x, y, vx, y, p));
-                if (is_piece(g.pieces, vx, y)) break; // if piece there
-            }
-            for (int8_t vy = y - 1; vy >= 0; vy --) {
-                if (!is_piece(allies, x, vy)) add_move(moves, length, move_of(x, y, x, vy, p));
-                if (is_piece(g.pieces, x, vy)) break; // if piece there
-            }
-            for (int8_t vy = y + 1; vy < 8; vy ++) {
-                if (!is_piece(allies, x, vy)) add_move(moves, length, move_of(x, y, x, vy, p));
-                if (is_piece(g.pieces, x, vy)) break; // if piece there
-            }
-            return;
-        case KING:
-            if (!is_piece(allies, x - 1, y - 1))    add_move(moves, length, move_of(x, y, x - 1, y - 1, p)); // these lines look like a crown :3
-            if (!is_piece(allies, x, y - 1))        add_move(moves, length, move_of(x, y, x, y - 1, p));
-            if (!is_piece(allies, x + 1, y - 1))    add_move(moves, length, move_of(x, y, x + 1, y - 1, p));
-            if (!is_piece(allies, x - 1, y))        add_move(moves, length, move_of(x, y, x - 1, y, p));
-            if (!is_piece(allies, x + 1, y))        add_move(moves, length, move_of(x, y, x + 1, y, p));
-            if (!is_piece(allies, x - 1, y + 1))    add_move(moves, length, move_of(x, y, x - 1, y + 1, p));
-            if (!is_piece(allies, x, y + 1))        add_move(moves, length, move_of(x, y, x, y + 1, p));
-            if (!is_piece(allies, x + 1, y + 1))    add_move(moves, length, move_of(x, y, x + 1, y + 1, p));
-            {
-                bool left_castle = c == WHITE ? g.white_left_castle : g.black_left_castle;
-                bool right_castle = c == WHITE ? g.white_right_castle : g.black_right_castle;
-                if (left_castle && !(c == WHITE ? g.white_in_check : g.black_in_check)) {
-                    bool open = true;
-                    for (uint8_t i = x - 1; i > 0; i --) if (is_piece(g.pieces, i, y)) open = false;
-                    if (open) add_move(moves, length, move_of(x, y, x - 2, y, p)); 
-                }
-                if (right_castle && !(c == WHITE ? g.white_in_check : g.black_in_check)) {
-                    bool open = true;
-                    for (uint8_t i = x + 1; i < 7; i ++) if (is_piece(g.pieces, i, y)) open = false;
-                    if (open) add_move(moves, length, move_of(x, y, x + 2, y, p)); 
-                }
-            }
-            return;
+// the moves of all the pawns in ps that end on a square in allowed, pushed or capturing together
+template <color C> static void add_pawn_moves(const game& g, pieces_set ps, targets_set allowed, move_list& list) {
+    const int8_t F = side<C>::forward;
+    pieces_set enemies = side<side<C>::enemy>::own(g), empty = ~g.pieces;
+    targets_set single = shift<F>(ps) & empty;
+    add_pawn_targets<C, F>(list, single & allowed);
+    add_pawn_targets<C, 2 * F>(list, shift<F>(single & side<C>::push_row) & empty & allowed);
+    add_pawn_targets<C, F - 1>(list, shift<F - 1>(ps & ~file_a) & enemies & allowed);
+    add_pawn_targets<C, F + 1>(list, shift<F + 1>(ps & ~file_h) & enemies & allowed);
+}
+
+// the moves of all the K pieces in ps that end on a square in allowed, castling aside
+template <color C, kind K> static void add_piece_moves(const game& g, pieces_set ps, targets_set allowed, move_list& list) {
+    allowed &= ~side<C>::own(g);
+    for (; ps; ps &= ps - 1) {
+        uint8_t sq = __builtin_ctzll(ps);
+        add_targets(list, sq, attacks<K>(sq, g.pieces) & allowed, g.pieces);
+    }
+}
+
+// adds the moves of the piece on sq that end on a square in allowed, castling aside
+template <color C> static void add_moves(const game& g, uint8_t sq, targets_set allowed, move_list& list) {
+    pieces_set bit = 1ull << sq;
+    switch (get_kind(g.b, sq % 8, sq / 8)) {
+        case PAWN: return add_pawn_moves<C>(g, bit, allowed, list);
+        case KNIGHT: return add_piece_moves<C, KNIGHT>(g, bit, allowed, list);
+        case BISHOP: return add_piece_moves<C, BISHOP>(g, bit, allowed, list);
+        case ROOK: return add_piece_moves<C, ROOK>(g, bit, allowed, list);
+        case QUEEN: return add_piece_moves<C, QUEEN>(g, bit, allowed, list);
+        case KING: return add_piece_moves<C, KING>(g, bit, allowed, list);
         default: return;
     }
 }
 
-void add_moves(const game& g, color c, move* moves, uint8_t& length) {
-    for (int8_t x = 0; x < 8; x ++) {
-        for (int8_t y = 0; y < 8; y ++) {
-            if (get_color(g.b, x, y) == c) add_moves(g, c, x, y, moves, length);
+template <color C> static void add_castles(const game& g, uint8_t sq, move_list& list) {
+    const uint8_t y = side<C>::back_row;
+    if (sq != y * 8 + 4 || side<C>::in_check(g)) return; // king has to be on its starting square
+    piece rook = make_piece(C, ROOK);
+    const pieces_set left_path = 0x0eull << 8 * y, right_path = 0x60ull << 8 * y; // squares between king and rook
+    if (side<C>::left_castle(g) && get_piece(g.b, 0, y) == rook && !(g.pieces & left_path))
+        list.moves[list.length ++] = move_of(4, y, 2, y, false, CASTLING);
+    if (side<C>::right_castle(g) && get_piece(g.b, 7, y) == rook && !(g.pieces & right_path))
+        list.moves[list.length ++] = move_of(4, y, 6, y, false, CASTLING);
+}
+
+// plays out the moves from start on and drops any that leave C in check
+template <color C> static void filter_legal(game& g, move_list& list, uint16_t start) {
+    move* writer = list.moves + start;
+    for (uint16_t i = start; i < list.length; i ++) {
+        move m = list.moves[i];
+        undo u;
+        make_move(g, m, u);
+        if (!side<C>::in_check(g)) *writer++ = m;
+        unmake_move(g, u);
+    }
+    list.length = writer - list.moves;
+}
+
+template <color C> static void add_moves(game& g, move_list& list, move_filter filter) {
+    const color enemy = side<C>::enemy;
+    pieces_set allies = side<C>::own(g), enemies = side<enemy>::own(g), king = side<C>::king(g);
+    uint16_t start = list.length;
+
+    // destinations each piece may use under the filter, pawns reaching the last row counting as captures
+    targets_set wanted = filter == CAPTURES ? enemies : filter == QUIETS ? ~g.pieces : ~0ull;
+    targets_set pawn_wanted = filter == CAPTURES ? enemies | side<C>::last_row
+        : filter == QUIETS ? ~g.pieces & ~side<C>::last_row : ~0ull;
+
+    if (__builtin_popcountll(king) != 1) { // no king or several of them, just try every move
+        for (pieces_set rest = allies; rest; rest &= rest - 1) {
+            uint8_t sq = __builtin_ctzll(rest);
+            add_moves<C>(g, sq, g.pawns >> sq & 1 ? pawn_wanted : wanted, list);
+            if (king >> sq & 1 && filter != CAPTURES) add_castles<C>(g, sq, list);
+        }
+        filter_legal<C>(g, list, start);
+        return;
+    }
+    uint8_t ksq = __builtin_ctzll(king);
+
+    // when in check, other pieces have to capture a lone checker or block its ray
+    targets_set evasions = ~0ull;
+    if (side<C>::in_check(g)) {
+        pieces_set checkers = attackers_to(g, ksq, g.pieces) & enemies;
+        if (checkers & (checkers - 1)) evasions = 0;
+        else if (checkers) evasions = checkers | between_table[ksq][__builtin_ctzll(checkers)];
+    }
+
+    // a lone ally between the king and an enemy slider can only move along that ray
+    pieces_set pinned = 0;
+    pieces_set snipers = (bishop_targets(ksq, enemies) & (g.bishops | g.queens) & enemies)
+        | (rook_targets(ksq, enemies) & (g.rooks | g.queens) & enemies);
+    for (; snipers; snipers &= snipers - 1) {
+        uint8_t sq = __builtin_ctzll(snipers);
+        pieces_set blockers = between_table[ksq][sq] & g.pieces;
+        if (!blockers || blockers & (blockers - 1)) continue;
+        uint8_t from = __builtin_ctzll(blockers);
+        pinned |= blockers;
+        targets_set ray = evasions & (between_table[ksq][sq] | 1ull << sq);
+        add_moves<C>(g, from, ray & (g.pawns >> from & 1 ? pawn_wanted : wanted), list);
+    }
+    pieces_set rest = allies & ~pinned;
+    add_pawn_moves<C>(g, g.pawns & rest, evasions & pawn_wanted, list);
+    add_piece_moves<C, KNIGHT>(g, g.knights & rest, evasions & wanted, list);
+    add_piece_moves<C, BISHOP>(g, g.bishops & rest, evasions & wanted, list);
+    add_piece_moves<C, ROOK>(g, g.rooks & rest, evasions & wanted, list);
+    add_piece_moves<C, QUEEN>(g, g.queens & rest, evasions & wanted, list);
+
+    // the king can't hide behind itself, so sliders that target it see through its square
+    targets_set danger = side<enemy>::targets(g);
+    if (side<enemy>::slider_targets(g) & king) danger |= find_slider_targets<enemy>(g, g.pieces & ~king);
+    add_piece_moves<C, KING>(g, king, ~danger & wanted, list);
+
+    // castling still gets played out to see where the king and rook end up
+    if (filter == CAPTURES) return;
+    start = list.length;
+    add_castles<C>(g, ksq, list);
+    filter_legal<C>(g, list, start);
+}
+
+void add_moves(game& g, color c, move_list& list, move_filter filter) {
+    if (c == WHITE) add_moves<WHITE>(g, list, filter);
+    else add_moves<BLACK>(g, list, filter);
+}
+
+template <color C> static bool is_legal(game& g, move m) {
+    uint8_t sq = m.src_y * 8 + m.src_x;
+    piece p = get_piece(g.b, m.src_x, m.src_y);
+    if (!p || get_color(p) != C) return false;
+    move_list list;
+    list.length = 0;
+    add_moves<C>(g, sq, 1ull << (m.dst_y * 8 + m.dst_x), list);
+    if (get_kind(p) == KING) add_castles<C>(g, sq, list);
+    for (uint16_t i = 0; i < list.length; i ++) {
+        if (list.moves[i] != m) continue;
+        list.length = i + 1;
+        filter_legal<C>(g, list, i);
+        return list.length > i;
+    }
+    return false;
+}
+
+bool is_legal(game& g, color c, move m) {
+    return c == WHITE ? is_legal<WHITE>(g, m) : is_legal<BLACK>(g, m);
+}
+
+void add_moves(const game& g, color c, move_list& list) {
+    game copy = g;
+    add_moves(copy, c, list);
+}
+
+// Perft results are cached by position and depth in a table shared by all threads. Entries
+// are read and written without locks: check holds key ^ data, so a slot torn by two threads
+// writing at once just fails the check on the next read.
+struct perft_entry {
+    uint64_t check, data; // data is the node count, with the depth in the top byte
+};
+
+struct perft_cache {
+    perft_entry* entries;
+    uint64_t mask;
+};
+
+static uint64_t perft_key(const game& g, color c, uint8_t depth) {
+    return game_key(g, c) ^ depth * 0x9e3779b97f4a7c15ull; // spread the depths over the table
+}
+
+static uint64_t perft(game& g, color c, uint8_t depth, perft_cache* cache) {
+    if (!depth) return 1;
+    move_list list;
+    add_moves(g, c, list);
+    if (depth == 1) return list.length; // no need to play out the leaves
+
+    uint64_t key = 0;
+    perft_entry* entry = nullptr;
+    if (cache) {
+        key = perft_key(g, c, depth);
+        entry = cache->entries + (key & cache->mask);
+        uint64_t check = __atomic_load_n(&entry->check, __ATOMIC_RELAXED), data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+        if ((check ^ data) == key && data >> 56 == depth) return data & 0xffffffffffffffull;
+    }
+
+    uint64_t nodes = 0;
+    for (uint16_t i = 0; i < list.length; i ++) {
+        undo u;
+        make_move(g, list.moves[i], u);
+        nodes += perft(g, c == WHITE ? BLACK : WHITE, depth - 1, cache);
+        unmake_move(g, u);
+    }
+
+    if (entry) {
+        uint64_t data = nodes | uint64_t(depth) << 56;
+        __atomic_store_n(&entry->check, key ^ data, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->data, data, __ATOMIC_RELAXED);
+    }
+    return nodes;
+}
+
+uint64_t perft(game& g, color c, uint8_t depth) {
+    return perft(g, c, depth, nullptr);
+}
+
+// one subtree a couple of plies below the root
+struct perft_task {
+    game g;
+    color c;
+    uint16_t root; // index of the root move it descends from
+};
+
+// Every thread starts out with an even share of the tasks, kept as a [begin, end) range
+// packed into one word. Threads take tasks from the front of their own range, and once
+// it runs dry, steal the back half of the largest remaining range.
+struct perft_job {
+    perft_task* tasks;
+    uint64_t* ranges;
+    uint64_t* root_counts;
+    perft_cache* cache;
+    uint8_t depth, threads; // depth left below each task
+};
+
+struct perft_worker {
+    perft_job* job;
+    uint8_t index;
+    pthread_t thread;
+};
+
+static bool next_task(perft_job& job, uint8_t self, uint32_t& task) {
+    uint64_t* own = job.ranges + self;
+    uint64_t range = __atomic_load_n(own, __ATOMIC_ACQUIRE);
+    while (uint32_t(range) < range >> 32) {
+        if (__atomic_compare_exchange_n(own, &range, range + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            task = uint32_t(range);
+            return true;
         }
     }
-    move* writer = moves;
-    const move* reader = moves;
-    for (uint8_t i = 0; i < length; i ++) {
-        move m = reader[i];
-        game copy = g;
-        move_piece(copy, m);
-        if (c == WHITE && !copy.white_in_check) *writer++ = m;
-        else if (c == BLACK && !copy.black_in_check) *writer++ = m;
+    while (true) {
+        uint64_t* victim = nullptr;
+        uint32_t most = 0;
+        for (uint8_t i = 0; i < job.threads; i ++) {
+            range = __atomic_load_n(job.ranges + i, __ATOMIC_ACQUIRE);
+            uint32_t left = uint32_t(range) < range >> 32 ? (range >> 32) - uint32_t(range) : 0;
+            if (left > most) victim = job.ranges + i, most = left;
+        }
+        if (!victim) return false;
+
+        range = __atomic_load_n(victim, __ATOMIC_ACQUIRE);
+        uint32_t begin = range, end = range >> 32;
+        if (begin >= end) continue;
+        uint32_t middle = begin + (end - begin) / 2;
+        if (__atomic_compare_exchange_n(victim, &range, begin | uint64_t(middle) << 32, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            task = middle;
+            __atomic_store_n(own, (middle + 1) | uint64_t(end) << 32, __ATOMIC_RELEASE);
+            return true;
+        }
     }
-    length = writer - moves;
+}
+
+static void* run_perft_worker(void* arg) {
+    perft_worker& worker = *(perft_worker*)arg;
+    perft_job& job = *worker.job;
+    uint32_t task;
+    while (next_task(job, worker.index, task)) {
+        perft_task& t = job.tasks[task];
+        uint64_t nodes = perft(t.g, t.c, job.depth, job.cache);
+        __atomic_fetch_add(job.root_counts + t.root, nodes, __ATOMIC_RELAXED);
+    }
+    return nullptr;
+}
+
+// collects every position plies moves below g into tasks, growing the array as needed
+static void add_perft_tasks(game& g, color c, uint8_t plies, uint16_t root, perft_task*& tasks, uint32_t& length, uint32_t& capacity) {
+    if (!plies) {
+        if (length == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            tasks = (perft_task*)realloc(tasks, capacity * sizeof(perft_task));
+        }
+        tasks[length ++] = { g, c, root };
+        return;
+    }
+    move_list list;
+    add_moves(g, c, list);
+    for (uint16_t i = 0; i < list.length; i ++) {
+        undo u;
+        make_move(g, list.moves[i], u);
+        add_perft_tasks(g, c == WHITE ? BLACK : WHITE, plies - 1, root, tasks, length, capacity);
+        unmake_move(g, u);
+    }
+}
+
+uint64_t parallel_perft(const game& g, color c, uint8_t depth, uint8_t threads, uint32_t hash_mb, uint64_t* root_counts) {
+    game copy = g;
+    move_list list;
+    add_moves(copy, c, list);
+    for (uint16_t i = 0; i < list.length; i ++) root_counts[i] = depth > 1 ? 0 : 1;
+    if (depth < 2) return depth ? list.length : 1;
+    if (!threads) threads = 1;
+
+    perft_cache cache = { nullptr, 0 };
+    if (hash_mb) {
+        uint64_t size = 1;
+        while (size * 2 * sizeof(perft_entry) <= uint64_t(hash_mb) << 20) size *= 2;
+        cache.entries = (perft_entry*)calloc(size, sizeof(perft_entry));
+        cache.mask = size - 1;
+    }
+
+    // split two plies below the root when there is enough depth left, for plenty of small tasks
+    uint8_t plies = depth > 3 ? 2 : 1;
+    perft_task* tasks = nullptr;
+    uint32_t num_tasks = 0, capacity = 0;
+    for (uint16_t i = 0; i < list.length; i ++) {
+        undo u;
+        make_move(copy, list.moves[i], u);
+        add_perft_tasks(copy, c == WHITE ? BLACK : WHITE, plies - 1, i, tasks, num_tasks, capacity);
+        unmake_move(copy, u);
+    }
+
+    uint64_t* ranges = (uint64_t*)malloc(threads * sizeof(uint64_t));
+    for (uint8_t i = 0; i < threads; i ++) {
+        uint64_t begin = uint64_t(num_tasks) * i / threads, end = uint64_t(num_tasks) * (i + 1) / threads;
+        ranges[i] = begin | end << 32;
+    }
+    perft_job job = { tasks, ranges, root_counts, hash_mb ? &cache : nullptr, uint8_t(depth - plies), threads };
+    perft_worker* workers = (perft_worker*)malloc(threads * sizeof(perft_worker));
+    for (uint8_t i = 0; i < threads; i ++) {
+        workers[i].job = &job, workers[i].index = i;
+        if (i && pthread_create(&workers[i].thread, nullptr, run_perft_worker, workers + i)) {
+            fprintf(stderr, "Could not start perft thread %u, continuing with fewer.\n", i);
+            workers[i].index = 0; // not running, nothing to join
+        }
+    }
+    run_perft_worker(workers); // the calling thread works too
+    for (uint8_t i = 1; i < threads; i ++) if (workers[i].index) pthread_join(workers[i].thread, nullptr);
+
+    free(workers);
+    free(ranges);
+    free(tasks);
+    free(cache.entries);
+
+    uint64_t nodes = 0;
+    for (uint16_t i = 0; i < list.length; i ++) nodes += root_counts[i];
+    return nodes;
+}
+
+uint64_t print_perft(game& g, color c, uint8_t depth, bool divide, uint8_t threads, uint32_t hash_mb) {
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t root_counts[MAX_MOVES];
+    uint64_t nodes = parallel_perft(g, c, depth, threads, hash_mb, root_counts);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (divide && depth) {
+        move_list list;
+        add_moves(g, c, list);
+        for (uint16_t i = 0; i < list.length; i ++) {
+            char name[8];
+            move_to_string(list.moves[i], name);
+            printf("%s: %llu\n", name, (unsigned long long)root_counts[i]);
+        }
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Nodes: %llu\n", (unsigned long long)nodes);
+    printf("Time: %.3fs (%.0f nodes/s)\n", seconds, seconds > 0 ? nodes / seconds : 0.0);
+    return nodes;
+}
+
+// Piece-square bonuses in centipawns, laid out as seen from white's side of the board
+// (top row is rank 8). Kings use the first table while there is material left to
+// attack them and drift to the second as it comes off.
+static const int8_t square_values[8][64] = {
+    {}, {},
+    { // pawn
+          0,   0,   0,   0,   0,   0,   0,   0,
+         50,  50,  50,  50,  50,  50,  50,  50,
+         10,  10,  20,  30,  30,  20,  10,  10,
+          5,   5,  10,  25,  25,  10,   5,   5,
+          0,   0,   0,  20,  20,   0,   0,   0,
+          5,  -5, -10,   0,   0, -10,  -5,   5,
+          5,  10,  10, -20, -20,  10,  10,   5,
+          0,   0,   0,   0,   0,   0,   0,   0 },
+    { // knight
+        -50, -40, -30, -30, -30, -30, -40, -50,
+        -40, -20,   0,   0,   0,   0, -20, -40,
+        -30,   0,  10,  15,  15,  10,   0, -30,
+        -30,   5,  15,  20,  20,  15,   5, -30,
+        -30,   0,  15,  20,  20,  15,   0, -30,
+        -30,   5,  10,  15,  15,  10,   5, -30,
+        -40, -20,   0,   5,   5,   0, -20, -40,
+        -50, -40, -30, -30, -30, -30, -40, -50 },
+    { // bishop
+        -20, -10, -10, -10, -10, -10, -10, -20,
+        -10,   0,   0,   0,   0,   0,   0, -10,
+        -10,   0,   5,  10,  10,   5,   0, -10,
+        -10,   5,   5,  10,  10,   5,   5, -10,
+        -10,   0,  10,  10,  10,  10,   0, -10,
+        -10,  10,  10,  10,  10,  10,  10, -10,
+        -10,   5,   0,   0,   0,   0,   5, -10,
+        -20, -10, -10, -10, -10, -10, -10, -20 },
+    { // rook
+          0,   0,   0,   0,   0,   0,   0,   0,
+          5,  10,  10,  10,  10,  10,  10,   5,
+         -5,   0,   0,   0,   0,   0,   0,  -5,
+         -5,   0,   0,   0,   0,   0,   0,  -5,
+         -5,   0,   0,   0,   0,   0,   0,  -5,
+         -5,   0,   0,   0,   0,   0,   0,  -5,
+         -5,   0,   0,   0,   0,   0,   0,  -5,
+          0,   0,   0,   5,   5,   0,   0,   0 },
+    { // queen
+        -20, -10, -10,  -5,  -5, -10, -10, -20,
+        -10,   0,   0,   0,   0,   0,   0, -10,
+        -10,   0,   5,   5,   5,   5,   0, -10,
+         -5,   0,   5,   5,   5,   5,   0,  -5,
+          0,   0,   5,   5,   5,   5,   0,  -5,
+        -10,   5,   5,   5,   5,   5,   0, -10,
+        -10,   0,   5,   0,   0,   0,   0, -10,
+        -20, -10, -10,  -5,  -5, -10, -10, -20 },
+    { // king
+        -30, -40, -40, -50, -50, -40, -40, -30,
+        -30, -40, -40, -50, -50, -40, -40, -30,
+        -30, -40, -40, -50, -50, -40, -40, -30,
+        -30, -40, -40, -50, -50, -40, -40, -30,
+        -20, -30, -30, -40, -40, -30, -30, -20,
+        -10, -20, -20, -20, -20, -20, -20, -10,
+         20,  20,   0,   0,   0,   0,  20,  20,
+         20,  30,  10,   0,   0,  10,  30,  20 },
+};
+
+static const int8_t king_endgame_values[64] = {
+    -50, -40, -30, -20, -20, -30, -40, -50,
+    -30, -20, -10,   0,   0, -10, -20, -30,
+    -30, -10,  20,  30,  30,  20, -10, -30,
+    -30, -10,  30,  40,  40,  30, -10, -30,
+    -30, -10,  30,  40,  40,  30, -10, -30,
+    -30, -10,  20,  30,  30,  20, -10, -30,
+    -30, -30,   0,   0,   0,   0, -30, -30,
+    -50, -30, -30, -30, -30, -30, -30, -50,
+};
+
+// Pawn structure and material balance only change with pawn moves and captures, so each
+// thread keeps what it worked out for them by pawn_key and material_key.
+#define PAWN_CACHE_SIZE 8192
+#define MATERIAL_CACHE_SIZE 1024
+
+struct pawn_entry {
+    uint64_t key;
+    score value; // white's point of view
+};
+
+struct material_entry {
+    uint64_t key;
+    int32_t value; // white's point of view
+    int32_t phase; // 24 with all minor and major pieces on the board, 0 with none
+};
+
+static thread_local pawn_entry pawn_cache[PAWN_CACHE_SIZE];
+static thread_local material_entry material_cache[MATERIAL_CACHE_SIZE];
+
+static const score passed_values[8] = { 0, 5, 10, 20, 35, 60, 100, 0 }; // by rank, from the pawn's side
+
+// doubled and isolated pawns, and passed pawns by how far they've come
+static score pawn_structure(pieces_set ours, pieces_set theirs, color c) {
+    score total = 0;
+    for (uint8_t x = 0; x < 8; x ++) {
+        pieces_set file = file_a << x;
+        pieces_set neighbors = (x > 0 ? file >> 1 : 0) | (x < 7 ? file << 1 : 0);
+        uint8_t count = __builtin_popcountll(ours & file);
+        if (count > 1) total -= 15 * (count - 1); // doubled
+        if (count && !(ours & neighbors)) total -= 12 * count; // isolated
+        for (pieces_set rest = ours & file; rest; rest &= rest - 1) {
+            uint8_t y = __builtin_ctzll(rest) / 8;
+            pieces_set ahead = c == WHITE ? ~0ull << 8 * y << 8 : (1ull << 8 * y) - 1;
+            if (!(theirs & (file | neighbors) & ahead)) total += passed_values[c == WHITE ? y : 7 - y];
+        }
+    }
+    return total;
+}
+
+static const pawn_entry& probe_pawns(const game& g) {
+    pawn_entry& e = pawn_cache[g.pawn_key & (PAWN_CACHE_SIZE - 1)];
+    if (e.key != g.pawn_key || !g.pawn_key) {
+        pieces_set white = g.pawns & g.white_pieces, black = g.pawns & g.black_pieces;
+        e.key = g.pawn_key;
+        e.value = pawn_structure(white, black, WHITE) - pawn_structure(black, white, BLACK);
+    }
+    return e;
+}
+
+// bishop pair, and knights gaining and rooks losing with the pawns left on the board
+static int32_t imbalance(uint8_t pawns, uint8_t knights, uint8_t bishops, uint8_t rooks) {
+    return (bishops >= 2 ? 30 : 0) + knights * 6 * (pawns - 5) - rooks * 12 * (pawns - 5);
+}
+
+static const material_entry& probe_material(const game& g) {
+    material_entry& e = material_cache[g.material_key & (MATERIAL_CACHE_SIZE - 1)];
+    if (e.key != g.material_key) {
+        pieces_set sides[2] = { g.white_pieces, g.black_pieces };
+        int32_t counts[2][8];
+        for (uint8_t i = 0; i < 2; i ++) {
+            counts[i][PAWN] = __builtin_popcountll(g.pawns & sides[i]);
+            counts[i][KNIGHT] = __builtin_popcountll(g.knights & sides[i]);
+            counts[i][BISHOP] = __builtin_popcountll(g.bishops & sides[i]);
+            counts[i][ROOK] = __builtin_popcountll(g.rooks & sides[i]);
+            counts[i][QUEEN] = __builtin_popcountll(g.queens & sides[i]);
+        }
+        e.key = g.material_key;
+        e.value = 0;
+        e.phase = 0;
+        for (uint8_t i = 0; i < 2; i ++) {
+            int32_t v = imbalance(counts[i][PAWN], counts[i][KNIGHT], counts[i][BISHOP], counts[i][ROOK]);
+            e.value += i ? -v : v;
+            e.phase += counts[i][KNIGHT] + counts[i][BISHOP] + 2 * counts[i][ROOK] + 4 * counts[i][QUEEN];
+        }
+        if (e.phase > 24) e.phase = 24;
+    }
+    return e;
+}
+
+score get_score(const game& g, color c) {
+    if (network_id) return network_score(g, c);
+
+    const material_entry& material = probe_material(g);
+    int phase = material.phase;
+    score total = material.value + probe_pawns(g).value; // white's point of view
+    for (pieces_set rest = g.pieces; rest; rest &= rest - 1) {
+        uint8_t sq = __builtin_ctzll(rest);
+        piece p = get_piece(g.b, sq % 8, sq / 8);
+        kind k = get_kind(p);
+        uint8_t i = get_color(p) == WHITE ? sq ^ 56 : sq; // flip white's rows to match the tables
+        score v = k == KING
+            ? (square_values[KING][i] * phase + king_endgame_values[i] * (24 - phase)) / 24
+            : piece_values[k] * 100 + square_values[k][i];
+        total += get_color(p) == WHITE ? v : -v;
+    }
+    return c == WHITE ? total : -total;
 }
 
 void update_game_state(game& g) {
-    g.white_pieces = find_pieces(g.b, WHITE), g.black_pieces = find_pieces(g.b, BLACK);
-    g.white_king = find_king(g.b, WHITE), g.black_king = find_king(g.b, BLACK);
+    board_sets sets;
+    find_sets(g.b, sets);
+    g.white_pieces = sets.white, g.black_pieces = sets.black;
+    g.white_king = sets.kinds[KING] & sets.white, g.black_king = sets.kinds[KING] & sets.black;
+    g.pawns = sets.kinds[PAWN], g.knights = sets.kinds[KNIGHT], g.bishops = sets.kinds[BISHOP];
+    g.rooks = sets.kinds[ROOK], g.queens = sets.kinds[QUEEN];
     g.pieces = g.white_pieces | g.black_pieces;
-    g.white_targets = find_targeted(g.b, g.pieces, WHITE), g.black_targets = find_targeted(g.b, g.pieces, BLACK); // compute enemy targets
-    g.white_in_check = g.white_king & g.black_targets;
-    g.black_in_check = g.black_king & g.white_targets;
+    g.key = castle_keys[castle_rights(g)];
+    g.pawn_key = g.material_key = 0;
+    for (pieces_set rest = g.pieces; rest; rest &= rest - 1) {
+        uint8_t sq = __builtin_ctzll(rest);
+        piece p = get_piece(g.b, sq % 8, sq / 8);
+        g.key ^= piece_keys[p][sq];
+        if (get_kind(p) == PAWN) g.pawn_key ^= piece_keys[p][sq];
+    }
+    for (uint8_t p = WHITE_PAWN; p <= BLACK_KING; p ++) {
+        for (uint8_t n = kind_set(g, piece(p)) ? piece_count(g, piece(p)) : 0; n; n --) g.material_key ^= material_keys[p][n];
+    }
+    g.white_slider_targets = find_slider_targets(g, WHITE, g.pieces), g.black_slider_targets = find_slider_targets(g, BLACK, g.pieces);
+    update_targets(g, 0, 0, 0);
 }
 
 void empty_game(game& g) {
     g.pieces = g.white_pieces = g.black_pieces = g.white_king = g.black_king = 0;
+    g.pawns = g.knights = g.bishops = g.rooks = g.queens = 0;
     g.white_in_check = g.black_in_check = false;
     g.white_targets = g.black_targets = 0;
+    g.white_slider_targets = g.black_slider_targets = 0;
     g.black_left_castle = g.black_right_castle = false;
     g.white_left_castle = g.white_right_castle = false;
+    g.key = g.pawn_key = g.material_key = 0;
+    g.halfmove_clock = 0, g.fullmove_number = 1;
 
-    for (uint8_t i = 0; i < 8; i ++) g.b.rows[i] = 0;
+    clear_board(g.b);
 }
 
 void setup_game(game& g) {
@@ -563,20 +1438,226 @@ pos pos_from_string(const char* pos_string) {
     return pos_of(x, y);
 }
 
+static const char kind_letters[] = "  pnbrqk";
+
+void move_to_string(move m, char* buffer) {
+    char* writer = buffer;
+    *writer ++ = 'a' + m.src_x, *writer ++ = '1' + m.src_y;
+    *writer ++ = 'a' + m.dst_x, *writer ++ = '1' + m.dst_y;
+    if (is_promotion(m)) *writer ++ = kind_letters[promoted_kind(m)];
+    *writer = '\0';
+}
+
+move move_from_string(game& g, color c, const char* move_string) {
+    pos from = pos_from_string(move_string);
+    if (from == INVALID_POS) return INVALID_MOVE;
+    pos dest = pos_from_string(move_string + 2);
+    if (dest == INVALID_POS) return INVALID_MOVE;
+    char promotion = move_string[4];
+    if (promotion >= 'A' && promotion <= 'Z') promotion += 32;
+
+    move_list list;
+    add_moves(g, c, list);
+    for (uint16_t i = 0; i < list.length; i ++) {
+        move m = list.moves[i];
+        if (m.src_x != from.x || m.src_y != from.y || m.dst_x != dest.x || m.dst_y != dest.y) continue;
+        if (!is_promotion(m) || kind_letters[promoted_kind(m)] == promotion) return m;
+    }
+    return INVALID_MOVE;
+}
+
+static const char fen_letters[] = "  PNBRQK  pnbrqk";
+
+color game_from_fen(game& g, const char* fen) {
+    empty_game(g);
+    const char* reader = fen;
+    while (*reader == ' ') reader ++;
+    int8_t y = 7, x = 0;
+    for (; *reader && *reader != ' '; reader ++) { // rank 8 first
+        if (*reader == '/') {
+            if (x != 8 || y == 0) return INVALID_COLOR;
+            y --, x = 0;
+        }
+        else if (*reader >= '1' && *reader <= '8') x += *reader - '0';
+        else {
+            const char* letter = strchr(fen_letters, *reader);
+            if (!letter || x >= 8) return INVALID_COLOR;
+            set_piece(g.b, x ++, y, piece(letter - fen_letters));
+        }
+        if (x > 8) return INVALID_COLOR;
+    }
+    if (y || x != 8) return INVALID_COLOR;
+
+    char side[2] = "", castles[5] = "", en_passant[3] = "";
+    unsigned halfmove = 0, fullmove = 1;
+    if (sscanf(reader, " %1s %4s %2s %u %u", side, castles, en_passant, &halfmove, &fullmove) < 2) return INVALID_COLOR;
+    color c = side[0] == 'w' ? WHITE : side[0] == 'b' ? BLACK : INVALID_COLOR;
+    g.white_right_castle = strchr(castles, 'K'), g.white_left_castle = strchr(castles, 'Q');
+    g.black_right_castle = strchr(castles, 'k'), g.black_left_castle = strchr(castles, 'q');
+    // there's no en passant in these rules, so that field is skipped
+    g.halfmove_clock = halfmove, g.fullmove_number = fullmove ? fullmove : 1;
+    // rights are kept only while the king and that rook are still home
+    g.white_left_castle &= get_piece(g.b, 4, 0) == WHITE_KING && get_piece(g.b, 0, 0) == WHITE_ROOK;
+    g.white_right_castle &= get_piece(g.b, 4, 0) == WHITE_KING && get_piece(g.b, 7, 0) == WHITE_ROOK;
+    g.black_left_castle &= get_piece(g.b, 4, 7) == BLACK_KING && get_piece(g.b, 0, 7) == BLACK_ROOK;
+    g.black_right_castle &= get_piece(g.b, 4, 7) == BLACK_KING && get_piece(g.b, 7, 7) == BLACK_ROOK;
+    update_game_state(g);
+
+    // one king a side, no pawns on the back ranks, and the side that just moved not left in check
+    if (__builtin_popcountll(g.white_king) != 1 || __builtin_popcountll(g.black_king) != 1) return INVALID_COLOR;
+    if (g.pawns & 0xff000000000000ffull) return INVALID_COLOR;
+    if (c == WHITE ? g.black_in_check : c == BLACK && g.white_in_check) return INVALID_COLOR;
+    return c;
+}
+
+void game_to_fen(const game& g, color c, char* buffer) {
+    char* writer = buffer;
+    for (int8_t y = 7; y >= 0; y --) {
+        uint8_t empty = 0;
+        for (int8_t x = 0; x < 8; x ++) {
+            piece p = get_piece(g.b, x, y);
+            if (!p) empty ++;
+            else {
+                if (empty) *writer ++ = '0' + empty, empty = 0;
+                *writer ++ = fen_letters[p];
+            }
+        }
+        if (empty) *writer ++ = '0' + empty;
+        if (y) *writer ++ = '/';
+    }
+    *writer ++ = ' ', *writer ++ = c == BLACK ? 'b' : 'w', *writer ++ = ' ';
+    const char* castles = writer;
+    if (g.white_right_castle) *writer ++ = 'K';
+    if (g.white_left_castle) *writer ++ = 'Q';
+    if (g.black_right_castle) *writer ++ = 'k';
+    if (g.black_left_castle) *writer ++ = 'q';
+    if (writer == castles) *writer ++ = '-';
+    sprintf(writer, " - %u %u", g.halfmove_clock, g.fullmove_number);
+}
+
+void move_to_san(game& g, move m, char* buffer) {
+    char* writer = buffer;
+    piece p = get_piece(g.b, m.src_x, m.src_y);
+    color c = get_color(p);
+    bool capture = get_piece(g.b, m.dst_x, m.dst_y);
+    if (is_castle(m)) writer += sprintf(writer, m.dst_x < m.src_x ? "O-O-O" : "O-O");
+    else {
+        if (get_kind(p) == PAWN) {
+            if (capture) *writer ++ = 'a' + m.src_x;
+        }
+        else {
+            *writer ++ = fen_letters[get_kind(p)];
+            // name the file, the rank or both if another piece of the kind can go there too
+            move_list list;
+            add_moves(g, c, list);
+            bool ambiguous = false, same_file = false, same_rank = false;
+            for (uint16_t i = 0; i < list.length; i ++) {
+                move n = list.moves[i];
+                if (n.dst_x != m.dst_x || n.dst_y != m.dst_y || get_piece(g.b, n.src_x, n.src_y) != p || (n.src_x == m.src_x && n.src_y == m.src_y)) continue;
+                ambiguous = true;
+                if (n.src_x == m.src_x) same_file = true;
+                if (n.src_y == m.src_y) same_rank = true;
+            }
+            if (ambiguous && (!same_file || same_rank)) *writer ++ = 'a' + m.src_x;
+            if (ambiguous && same_file) *writer ++ = '1' + m.src_y;
+        }
+        if (capture) *writer ++ = 'x';
+        *writer ++ = 'a' + m.dst_x, *writer ++ = '1' + m.dst_y;
+        if (is_promotion(m)) *writer ++ = '=', *writer ++ = fen_letters[promoted_kind(m)];
+    }
+
+    undo u;
+    make_move(g, m, u);
+    color enemy = c == WHITE ? BLACK : WHITE;
+    if (enemy == WHITE ? g.white_in_check : g.black_in_check) {
+        move_list replies;
+        add_moves(g, enemy, replies);
+        *writer ++ = replies.length ? '+' : '#';
+    }
+    unmake_move(g, u);
+    *writer = '\0';
+}
+
+move move_from_san(game& g, color c, const char* san) {
+    char wanted[16];
+    uint8_t length = 0;
+    for (const char* reader = san; *reader && length < sizeof(wanted) - 1; reader ++) {
+        if (!strchr("+#!?", *reader)) wanted[length ++] = *reader == '0' ? 'O' : *reader; // 0-0 is seen too
+    }
+    wanted[length] = '\0';
+
+    move_list list;
+    add_moves(g, c, list);
+    for (uint16_t i = 0; i < list.length; i ++) {
+        char name[16];
+        move_to_san(g, list.moves[i], name);
+        uint8_t end = strcspn(name, "+#");
+        if (end == length && !strncmp(name, wanted, end)) return list.moves[i];
+    }
+    return move_from_string(g, c, san); // coordinate notation
+}
+
+// reads a line from stdin, space-terminated for strtok; false once stdin runs out
+static bool read_line(char* buffer, uint32_t size) {
+    uint32_t i = 0;
+    int ch;
+    while ((ch = fgetc(stdin)) != '\n' && ch != EOF) if (i < size - 2) buffer[i ++] = ch;
+    buffer[i ++] = ' ', buffer[i] = '\0';
+    return ch != EOF || i > 1;
+}
+
+// splitmix64, with a state per thread so games played side by side don't share one
+static thread_local uint64_t random_state = 0x2545f4914f6cdd1dull;
+
+void seed_random(uint64_t seed) {
+    random_state = seed;
+}
+
+uint32_t random_number() {
+    uint64_t z = random_state += 0x9e3779b97f4a7c15ull;
+    z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ z >> 27) * 0x94d049bb133111ebull;
+    return (z ^ z >> 31) >> 32;
+}
+
+uint32_t search_time_ms = 1000;
+uint32_t search_hash_mb = 16;
+uint8_t search_threads = 1;
+bool search_huge_pages = false;
+bool search_ponder = true;
+
 chess_ai ai_array[256];
 uint8_t ai_length = 0;
 
-void add_ai(const char* name, chess_ai_decider decider) {
+uint64_t monotonic_ms() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return uint64_t(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+decider_context context_for(uint32_t ms) {
+    return { monotonic_ms() + ms, 0, nullptr, nullptr, nullptr };
+}
+
+static void add_ai(const char* name, chess_ai_decider decider, blocking_decider blocking) {
     if (ai_length == 255) {
         fprintf(stderr, "Max AI limit reached.\n");
         return;
     }
     chess_ai ai;
     strncpy(ai.name, name, 32);
-    ai.decider = decider;
+    ai.decider = decider, ai.blocking = blocking;
     ai_array[ai_length ++] = ai;
 }
 
+void add_ai(const char* name, chess_ai_decider decider) {
+    add_ai(name, decider, nullptr);
+}
+
+void add_ai(const char* name, blocking_decider decider) {
+    add_ai(name, nullptr, decider);
+}
+
 const chess_ai* find_ai(const char* name) {
     for (uint8_t i = 0; i < ai_length; i ++) {
         if (!strcmp(ai_array[i].name, name)) return ai_array + i;
@@ -584,11 +1665,132 @@ const chess_ai* find_ai(const char* name) {
     return nullptr;
 }
 
+void list_ais() {
+    fprintf(stderr, "Registered AI options:\n");
+    for (uint8_t i = 0; i < ai_length; i ++) fprintf(stderr, " - %s\n", ai_array[i].name);
+}
+
+// A blocking decider runs on a thread of its own with a copy of the position, so decide()
+// can stop waiting for it: it then sets stop, which decider_stopped() reads on that thread,
+// and joins the thread, taking the move the decider answers with.
+struct blocking_job {
+    game g;
+    color c;
+    move_list moves;
+    blocking_decider decider;
+    uint64_t seed; // from the caller's generator, so random deciders stay repeatable
+    move result;
+    bool done, stop;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+};
+
+static thread_local const bool* blocking_stop = nullptr; // the job's, on a blocking decider's thread
+
+bool decider_stopped() {
+    return blocking_stop && __atomic_load_n(blocking_stop, __ATOMIC_RELAXED);
+}
+
+static void* run_blocking_job(void* arg) {
+    blocking_job* job = (blocking_job*)arg;
+    seed_random(job->seed);
+    blocking_stop = &job->stop;
+    move m = job->decider(job->g, job->c, job->moves);
+    pthread_mutex_lock(&job->lock);
+    job->result = m, job->done = true;
+    pthread_cond_signal(&job->finished);
+    pthread_mutex_unlock(&job->lock);
+    return nullptr;
+}
+
+static bool out_of_time(const decider_context& context) {
+    return (context.stop && __atomic_load_n(context.stop, __ATOMIC_RELAXED))
+        || (context.deadline_ms && monotonic_ms() >= context.deadline_ms);
+}
+
+move decide(const chess_ai& ai, const game& g, color c, const move_list& moves, const decider_context& context) {
+    if (ai.decider) return ai.decider(g, c, moves, context);
+    if (!context.deadline_ms && !context.stop) return ai.blocking(g, c, moves);
+
+    blocking_job job;
+    job.g = g, job.c = c, job.moves = moves, job.decider = ai.blocking;
+    job.seed = uint64_t(random_number()) << 32 | random_number();
+    job.done = job.stop = false;
+    pthread_mutex_init(&job.lock, nullptr);
+    pthread_cond_init(&job.finished, nullptr);
+    pthread_t thread;
+    bool started = !pthread_create(&thread, nullptr, run_blocking_job, &job);
+    if (started) {
+        pthread_mutex_lock(&job.lock);
+        while (!job.done && !out_of_time(context)) { // the stop flag can't signal, so look again every millisecond
+            timespec wake;
+            clock_gettime(CLOCK_REALTIME, &wake);
+            wake.tv_nsec += 1000000;
+            if (wake.tv_nsec >= 1000000000l) wake.tv_sec ++, wake.tv_nsec -= 1000000000l;
+            pthread_cond_timedwait(&job.finished, &job.lock, &wake);
+        }
+        pthread_mutex_unlock(&job.lock);
+        __atomic_store_n(&job.stop, true, __ATOMIC_RELAXED);
+        pthread_join(thread, nullptr);
+    }
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.finished);
+    return started ? job.result : ai.blocking(g, c, moves);
+}
+
+// Searches the position after the reply the AI expects while the human thinks. If the human
+// plays it, the search carries on as the AI's own; if not, it stops, and what it found is
+// still in the transposition table.
+struct ponder_job {
+    const chess_ai* ai;
+    game g; // with the expected reply played
+    color c;
+    move expected, result, reply;
+    bool stop, done;
+    uint64_t started_ms; // on monotonic_ms()'s clock
+    pthread_t thread;
+};
+
+static void* run_ponder(void* arg) {
+    ponder_job& p = *(ponder_job*)arg;
+    move_list list;
+    add_moves(p.g, p.c, list);
+    decider_context context = { 0, 0, &p.stop, &p.reply, nullptr };
+    p.result = list.length ? decide(*p.ai, p.g, p.c, list, context) : INVALID_MOVE;
+    __atomic_store_n(&p.done, true, __ATOMIC_RELEASE);
+    return nullptr;
+}
+
+// g is the position the human is to move in, and c the AI's color
+static bool start_pondering(ponder_job& p, const chess_ai* ai, const game& g, color c, move expected) {
+    p.ai = ai, p.g = g, p.c = c;
+    move_piece(p.g, expected);
+    p.expected = expected, p.result = p.reply = INVALID_MOVE;
+    p.stop = p.done = false;
+    p.started_ms = monotonic_ms();
+    return !pthread_create(&p.thread, nullptr, run_ponder, &p);
+}
+
+// lets the search run until ms after it started, time spent pondering included, then stops
+// it and returns its move
+static move stop_pondering(ponder_job& p, uint32_t ms) {
+    uint64_t deadline = p.started_ms + ms;
+    while (!__atomic_load_n(&p.done, __ATOMIC_ACQUIRE) && monotonic_ms() < deadline) {
+        timespec pause = { 0, 1000000 };
+        nanosleep(&pause, nullptr);
+    }
+    __atomic_store_n(&p.stop, true, __ATOMIC_RELAXED);
+    pthread_join(p.thread, nullptr);
+    return p.result;
+}
+
 void cmd_loop() {
-    srand(time(0));
+    seed_random(time(0));
 
     game g;
     setup_game(g);
+    color turn = WHITE; // who moves first in 'play'
+    opening_book book = {}; // consulted before the AI in 'play'
 
     bool done = false;
     printf(R"(
@@ -602,11 +1804,11 @@ Welcome to the Mockfish Chess engine! Type commands below, or 'help' to get star
 )");
     while (!done) {
         printf("➤ ");
-        char buffer[512], *writer = buffer, ch;
-        while ((ch = fgetc(stdin)) != '\n') *writer ++ = ch;
-        *writer ++ = ' ';
+        char buffer[512];
+        if (!read_line(buffer, sizeof(buffer))) break;
 
         const char* cmd = strtok(buffer, " \r\t");
+        if (!cmd) continue;
         if (!strcmp(cmd, "help")) {
             printf("Commands:\n");
             printf("➤ help\n");
@@ -623,6 +1825,22 @@ Welcome to the Mockfish Chess engine! Type commands below, or 'help' to get star
             printf("\tRemoves a piece from the board.\n");
             printf("➤ move <pos> to <pos>\n");
             printf("\tMoves a piece to a new position.\n");
+            printf("➤ fen [<fen>]\n");
+            printf("\tSets up the position described by a FEN string, or shows the current one.\n");
+            printf("➤ perft <depth> [<color>] [divide] [threads <n>] [hash <mb>]\n");
+            printf("\tCounts the move sequences of the given length, <color> (white by default) moving first.\n");
+            printf("\tWith 'divide', also shows the count after each first move. Can be split across threads,\n");
+            printf("\tand with a hash size, reuses the counts of positions that were already seen.\n");
+            printf("➤ book <file>|off\n");
+            printf("\tLets the AI in 'play' take its opening moves from a book built with makebook.\n");
+            printf("➤ tablebases <directory>\n");
+            printf("\tLets the searching AIs look up endgames in the tables built there with tbgen.\n");
+            printf("➤ network <file>|off\n");
+            printf("\tEvaluates positions with a network from the file, or with the built-in tables.\n");
+            printf("➤ set time|hash|threads|hugepages|ponder <n>\n");
+            printf("\tChanges how the searching AIs play: milliseconds per move, transposition table size in\n");
+            printf("\tmegabytes, threads to search with, 1 to try huge pages for the table or 0 not to, and\n");
+            printf("\t1 to think on your time in 'play' or 0 not to.\n");
             printf("➤ quit\n");
             printf("\tCloses the program.\n");
             printf("\n");
@@ -637,11 +1855,13 @@ Welcome to the Mockfish Chess engine! Type commands below, or 'help' to get star
         }
         else if (!strcmp(cmd, "reset")) {
             setup_game(g);
+            turn = WHITE;
             print_game(g);
             printf("Reset pieces to initial positions.\n");
         }
         else if (!strcmp(cmd, "clear")) {
             empty_game(g);
+            turn = WHITE;
             print_game(g);
             printf("Cleared board.\n");
         }
@@ -683,7 +1903,8 @@ Welcome to the Mockfish Chess engine! Type commands below, or 'help' to get star
                 fprintf(stderr, " - pos: any coordinate of the form [A-Ha-h][1-8], e.g. 'A2', 'e6'\n");
                 continue;
             }
-            move_piece(g, { from.x, from.y, dest.x, dest.y, get_piece(g.b, from.x, from.y) });
+            bool castling = get_kind(g.b, from.x, from.y) == KING && (dest.x == from.x + 2 || dest.x + 2 == from.x);
+            move_piece(g, move_of(from.x, from.y, dest.x, dest.y, get_piece(g.b, dest.x, dest.y) != EMPTY, castling ? CASTLING : NORMAL_MOVE));
             print_game(g);
         }
         else if (!strcmp(cmd, "moves")) {
@@ -693,21 +1914,20 @@ Welcome to the Mockfish Chess engine! Type commands below, or 'help' to get star
                 fprintf(stderr, " - color: either 'white' or 'black'\n");
                 continue;
             }
-            move moves[MAX_MOVES];
-            uint8_t num_moves = 0;
-            add_moves(g, c, moves, num_moves);
+            move_list list;
+            add_moves(g, c, list);
             targets_set endpoints = 0;
-            for (uint8_t i = 0; i < num_moves; i ++) {
-                set_targeted(endpoints, moves[i].dst_x, moves[i].dst_y);
+            for (uint16_t i = 0; i < list.length; i ++) {
+                set_targeted(endpoints, list.moves[i].dst_x, list.moves[i].dst_y);
             }
             print_targets(g, endpoints);
 
-            for (uint8_t i = 0; i < num_moves;) {
-                for (uint8_t j = 0; j < 4 && i < num_moves; i ++, j ++) {
+            for (uint16_t i = 0; i < list.length;) {
+                for (uint8_t j = 0; j < 4 && i < list.length; i ++, j ++) {
                     printf("%s %c%c to %c%c\t", 
-                        piece_icons[get_piece(g.b, moves[i].src_x, moves[i].src_y)],
-                        'a' + moves[i].src_x, '1' + moves[i].src_y,
-                        'a' + moves[i].dst_x, '1' + moves[i].dst_y);
+                        piece_icons[get_piece(g.b, list.moves[i].src_x, list.moves[i].src_y)],
+                        'a' + list.moves[i].src_x, '1' + list.moves[i].src_y,
+                        'a' + list.moves[i].dst_x, '1' + list.moves[i].dst_y);
                 }
                 printf("\n");
             }
@@ -751,17 +1971,14 @@ Welcome to the Mockfish Chess engine! Type commands below, or 'help' to get star
                 ai = find_ai(opponent);
                 if (!ai) {
                     fprintf(stderr, "Usage: play human|<ai> '%s'.\n", opponent);
-                    fprintf(stderr, "Registered AI options:\n");
-                    for (uint8_t i = 0; i < ai_length; i ++) fprintf(stderr, " - %s\n", ai_array[i].name);
+                    list_ais();
                     continue;
                 }
 
                 human = false;
                 while (human_color == INVALID_COLOR) {
                     printf("White or black?: ");
-                    writer = buffer;
-                    while ((ch = fgetc(stdin)) != '\n') *writer ++ = ch;
-                    *writer ++ = ' ';
+                    if (!read_line(buffer, sizeof(buffer))) return;
 
                     human_color = color_from_string(strtok(buffer, " \r\t"));
                     if (human_color == INVALID_COLOR) {
@@ -770,15 +1987,19 @@ Welcome to the Mockfish Chess engine! Type commands below, or 'help' to get star
                 }
             }
 
-            color player = WHITE;
+            color player = turn;
+            ponder_job ponder;
+            bool pondering = false; // only kept on while the human plays the expected reply
             while (true) {
                 print_game(g);
 
-                move moves[MAX_MOVES];
-                uint8_t length = 0;
-                add_moves(g, player, moves, length);
-                if (length == 0) {
-                    printf("Checkmate! %s player wins.\n", player == WHITE ? "Black" : "White");
+                move_list list;
+                add_moves(g, player, list);
+                if (list.length == 0) {
+                    if (player == WHITE ? g.white_in_check : g.black_in_check)
+                        printf("Checkmate! %s player wins.\n", player == WHITE ? "Black" : "White");
+                    else printf("Stalemate! The game is a draw.\n");
+                    if (pondering) stop_pondering(ponder, 0);
                     break;
                 }
 
@@ -788,16 +2009,38 @@ Welcome to the Mockfish Chess engine! Type commands below, or 'help' to get star
 
                 bool moved = false;
                 if (!human && player != human_color) {
-                    move m = ai->decider(g, player, moves, length);
+                    move m = INVALID_MOVE, reply = INVALID_MOVE;
+                    if (pondering) { // been searching this position since the AI's last move
+                        m = stop_pondering(ponder, search_time_ms), reply = ponder.reply;
+                        pondering = false;
+                        printf("Ponder hit.\n");
+                    }
+                    bool from_book = false;
+                    if (m == INVALID_MOVE) {
+                        m = probe_book(book, g, player);
+                        from_book = m != INVALID_MOVE;
+                    }
+                    if (from_book) {
+                        char name[16];
+                        move_to_san(g, m, name);
+                        printf("Book move %s.\n", name);
+                    }
+                    else if (m == INVALID_MOVE) {
+                        decider_context context = context_for(search_time_ms);
+                        context.reply = &reply;
+                        m = decide(*ai, g, player, list, context);
+                    }
                     move_piece(g, m);
+                    if (search_ponder && reply != INVALID_MOVE) pondering = start_pondering(ponder, ai, g, player, reply);
                 }
                 else while (!moved) {
                     printf("%s ", player == WHITE ? "⚐" : "⚑");
                     pos from, dest;
                     // use buffer from before
-                    writer = buffer;
-                    while ((ch = fgetc(stdin)) != '\n') *writer ++ = ch;
-                    *writer ++ = ' ';
+                    if (!read_line(buffer, sizeof(buffer))) {
+                        if (pondering) stop_pondering(ponder, 0);
+                        return;
+                    }
 
                     from = pos_from_string(strtok(buffer, " \r\t"));
                     const char* to = strtok(nullptr, " \r\t");
@@ -808,16 +2051,15 @@ Welcome to the Mockfish Chess engine! Type commands below, or 'help' to get star
                         continue;
                     }
 
-                    move choice = { from.x, from.y, dest.x, dest.y, get_piece(g.b, from.x, from.y) };
-
-                    if (is_promotion(choice)) {
-                        kind k = INVALID_KIND;
-
+                    // pawn moving to opposite row
+                    kind k = INVALID_KIND;
+                    if (get_kind(g.b, from.x, from.y) == PAWN && dest.y == (player == WHITE ? 7 : 0)) {
                         while (k == INVALID_KIND) {
                             printf("Which piece should your pawn promote to?: ");
-                            writer = buffer;
-                            while ((ch = fgetc(stdin)) != '\n') *writer ++ = ch;
-                            *writer ++ = ' ';
+                            if (!read_line(buffer, sizeof(buffer))) {
+                                if (pondering) stop_pondering(ponder, 0);
+                                return;
+                            }
 
                             k = kind_from_string(strtok(buffer, " \r\t"));
                             if (k == INVALID_KIND) {
@@ -828,13 +2070,14 @@ Welcome to the Mockfish Chess engine! Type commands below, or 'help' to get star
                                 k = INVALID_KIND;
                             }
                         }
-                        choice.p = make_piece(get_color(choice.p), k);
                     }
 
-                    for (uint8_t i = 0; i < length && !moved; i ++) {
-                        if (moves[i] == choice) {
-                            move_piece(g, moves[i]);
+                    for (uint16_t i = 0; i < list.length && !moved; i ++) {
+                        move m = list.moves[i];
+                        if (m.src_x == from.x && m.src_y == from.y && m.dst_x == dest.x && m.dst_y == dest.y && promoted_kind(m) == k) {
+                            move_piece(g, m);
                             moved = true;
+                            if (pondering && m != ponder.expected) stop_pondering(ponder, 0), pondering = false;
                         }
                     }
                     if (!moved) {
@@ -847,6 +2090,101 @@ Welcome to the Mockfish Chess engine! Type commands below, or 'help' to get star
                 player = player == WHITE ? BLACK : WHITE;
             }
         }
+        else if (!strcmp(cmd, "perft")) {
+            const char* depth_string = strtok(nullptr, " \r\t");
+            int depth = depth_string ? atoi(depth_string) : 0;
+            color c = WHITE;
+            bool divide = false;
+            int threads = 1, hash_mb = 0;
+            for (const char* arg = strtok(nullptr, " \r\t"); arg && c != INVALID_COLOR; arg = strtok(nullptr, " \r\t")) {
+                if (!strcmp(arg, "divide")) divide = true;
+                else if (!strcmp(arg, "threads")) threads = (arg = strtok(nullptr, " \r\t")) ? atoi(arg) : 0;
+                else if (!strcmp(arg, "hash")) hash_mb = (arg = strtok(nullptr, " \r\t")) ? atoi(arg) : -1;
+                else c = color_from_string(arg);
+            }
+            if (depth < 1 || depth > 20 || c == INVALID_COLOR || threads < 1 || threads > 255 || hash_mb < 0) {
+                fprintf(stderr, "Usage: perft <depth> [<color>] [divide] [threads <n>] [hash <mb>]\n");
+                fprintf(stderr, " - depth: number of moves to look ahead, from 1 to 20\n");
+                fprintf(stderr, " - color: either 'white' or 'black'\n");
+                fprintf(stderr, " - n: number of threads to count with, from 1 to 255\n");
+                fprintf(stderr, " - mb: size of the position cache in megabytes, 0 to disable\n");
+                continue;
+            }
+            print_perft(g, c, depth, divide, threads, hash_mb);
+        }
+        else if (!strcmp(cmd, "book")) {
+            const char* path = strtok(nullptr, " \r\t");
+            if (path && !strcmp(path, "off")) {
+                close_book(book);
+                printf("Book closed.\n");
+            }
+            else if (!path || !open_book(book, path)) {
+                fprintf(stderr, "Usage: book <file>|off\n");
+                fprintf(stderr, " - file: a book built with makebook, which must be readable\n");
+            }
+            else printf("Book opened with %llu moves.\n", (unsigned long long)book.length);
+        }
+        else if (!strcmp(cmd, "tablebases")) {
+            const char* directory = strtok(nullptr, " \r\t");
+            if (!directory) {
+                fprintf(stderr, "Usage: tablebases <directory>\n");
+                fprintf(stderr, " - directory: where tbgen wrote its .mtb files\n");
+                continue;
+            }
+            unload_tablebases();
+            uint32_t loaded = load_tablebases(directory);
+            printf("Loaded %u tables, for up to %u pieces.\n", loaded, tablebase_pieces);
+        }
+        else if (!strcmp(cmd, "network")) {
+            const char* path = strtok(nullptr, " \r\t");
+            if (path && !strcmp(path, "off")) {
+                unload_network();
+                printf("Network unloaded.\n");
+            }
+            else if (!path || !load_network(path)) {
+                fprintf(stderr, "Usage: network <file>|off\n");
+                fprintf(stderr, " - file: a network with %u hidden values per side\n", NNUE_HIDDEN);
+            }
+            else {
+                printf("Network loaded.\n");
+            }
+        }
+        else if (!strcmp(cmd, "fen")) {
+            const char* fen = strtok(nullptr, "\r\n");
+            if (fen) {
+                game parsed;
+                color c = game_from_fen(parsed, fen);
+                if (c == INVALID_COLOR) {
+                    fprintf(stderr, "Usage: fen [<fen>]\n");
+                    fprintf(stderr, " - fen: e.g. 'rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - 0 1'\n");
+                    continue;
+                }
+                g = parsed, turn = c;
+                print_game(g);
+            }
+            char buffer[MAX_FEN];
+            game_to_fen(g, turn, buffer);
+            printf("%s\n", buffer);
+        }
+        else if (!strcmp(cmd, "set")) {
+            const char* name = strtok(nullptr, " \r\t");
+            const char* value_string = strtok(nullptr, " \r\t");
+            long value = value_string ? atol(value_string) : -1;
+            if (!name || value < 0) name = "";
+            if (!strcmp(name, "time") && value > 0) search_time_ms = value;
+            else if (!strcmp(name, "hash") && value <= 65536) search_hash_mb = value;
+            else if (!strcmp(name, "threads") && value > 0 && value < 256) search_threads = value;
+            else if (!strcmp(name, "hugepages") && value < 2) search_huge_pages = value;
+            else if (!strcmp(name, "ponder") && value < 2) search_ponder = value;
+            else {
+                fprintf(stderr, "Usage: set time|hash|threads|hugepages|ponder <n>\n");
+                fprintf(stderr, " - time: milliseconds to think per move, currently %u\n", search_time_ms);
+                fprintf(stderr, " - hash: transposition table size in megabytes, currently %u\n", search_hash_mb);
+                fprintf(stderr, " - threads: threads to search with, from 1 to 255, currently %u\n", search_threads);
+                fprintf(stderr, " - hugepages: 1 to back the table with huge pages, currently %u\n", search_huge_pages);
+                fprintf(stderr, " - ponder: 1 to keep thinking while you do in 'play', currently %u\n", search_ponder);
+            }
+        }
         else if (!strcmp(cmd, "quit")) {
             done = true;
         }
@@ -2,8 +2,10 @@
 #define CHESS_H
 
 #include <cstdint>
+#include <cstring>
 
 #define MAX_MOVES 256
+#define MAX_FEN 96 // longest FEN game_to_fen() writes, with the terminator
 
 using score = int64_t;
 
@@ -41,42 +43,145 @@ enum piece : uint8_t {
     BLACK_KING = 15
 };
 
-struct board { 
-    uint32_t rows[8];
-};
-
 using targets_set = uint64_t;
 using pieces_set = uint64_t;
 
+// The board layout is picked at compile time by defining BITBOARD_BOARD or MAILBOX_BOARD,
+// packed nibbles being the default. Everything outside set_piece(), get_piece(),
+// clear_board() and find_sets() works the same on any of them; 'make bench' compares them.
+#if defined(BITBOARD_BOARD)
+struct board {
+    pieces_set pieces[16]; // by piece, pieces[EMPTY] unused
+};
+#elif defined(MAILBOX_BOARD)
+#define NO_SQUARE 64
+struct board {
+    piece squares[64];
+    uint8_t first[16]; // of the squares holding each piece, linked through next and previous
+    uint8_t next[64], previous[64];
+};
+#else
+#define NIBBLE_BOARD
+struct board {
+    uint32_t rows[8]; // a piece per 4 bits, file a lowest
+};
+#endif
+
+extern const char board_layout[]; // name of the layout compiled in
+
+// every bitboard the board alone determines, see find_sets()
+struct board_sets {
+    pieces_set white, black;
+    pieces_set kinds[8]; // both colors, by kind; INVALID_KIND is the empty squares
+};
+
 struct pos {
     uint8_t x : 3, y : 3, extra : 2;
 };
 
 extern const pos INVALID_POS;
 
+enum move_special : uint8_t {
+    NORMAL_MOVE = 0,
+    CASTLING = 1 // king two squares over, the rook jumping it
+    // promotions keep the kind promoted to, KNIGHT to QUEEN
+};
+
+// packed in 16 bits, so moves are compared and stored as a single number
 struct move {
-    uint8_t src_x : 3, src_y : 3, dst_x : 3, dst_y : 3;
-    piece p : 4;
+    uint16_t src_x : 3, src_y : 3, dst_x : 3, dst_y : 3;
+    uint16_t capture : 1;
+    uint16_t special : 3; // a move_special, or the kind a pawn promotes to
 };
 
+static_assert(sizeof(move) == 2, "move should pack into 16 bits");
+
 extern const move INVALID_MOVE;
 
+inline uint16_t move_bits(move m) {
+    uint16_t bits;
+    memcpy(&bits, &m, sizeof(bits));
+    return bits;
+}
+
+inline move move_from_bits(uint16_t bits) {
+    move m;
+    memcpy(&m, &bits, sizeof(m));
+    return m;
+}
+
+inline bool operator==(move a, move b) {
+    return move_bits(a) == move_bits(b);
+}
+
+inline bool operator!=(move a, move b) {
+    return move_bits(a) != move_bits(b);
+}
+
+// fixed size, so it can live on the stack or in a searcher's ply stack without allocating;
+// a uint16_t length can't wrap even with all MAX_MOVES taken
+struct move_list {
+    move moves[MAX_MOVES];
+    uint16_t length = 0;
+};
+
 struct game {
     board b;
     pieces_set pieces, white_pieces, black_pieces, white_king, black_king;
+    pieces_set pawns, knights, bishops, rooks, queens; // both colors
     targets_set white_targets, black_targets;
+    targets_set white_slider_targets, black_slider_targets; // bishop, rook and queen part of the targets
+    bool white_in_check, black_in_check;
+    bool white_left_castle, white_right_castle,
+        black_left_castle, black_right_castle;
+    uint64_t key; // zobrist key of the board and castling rights, see game_key()
+    uint64_t pawn_key; // of the pawns alone
+    uint64_t material_key; // of how many of each piece there are, wherever they stand
+    uint16_t halfmove_clock; // moves since the last capture or pawn move
+    uint16_t fullmove_number; // starts at 1, goes up after each black move
+};
+
+// everything make_move() overwrites, so unmake_move() can restore it
+struct undo {
+    move m;
+    piece moved, captured;
+    piece rook_moved, rook_captured; // castling only
+    targets_set white_targets, black_targets, white_slider_targets, black_slider_targets;
     bool white_in_check, black_in_check;
     bool white_left_castle, white_right_castle,
         black_left_castle, black_right_castle;
+    uint64_t key;
+    uint16_t halfmove_clock, fullmove_number;
+};
+
+enum move_filter : uint8_t {
+    CAPTURES = 1, // and promotions
+    QUIETS = 2, // everything else, castling included
+    ALL_MOVES = 3
 };
 
-using chess_ai_decider = move(*)(const game&, color, const move*, uint8_t);
+struct transposition_table; // see search.h
+
+// what a decider may spend on one move: once any of these runs out, it answers with
+// the best move found so far
+struct decider_context {
+    uint64_t deadline_ms; // on monotonic_ms()'s clock, 0 for none
+    uint64_t nodes; // positions searched, 0 for no limit
+    const bool* stop; // set from another thread to answer right away, or null
+    move* reply; // if not null, gets the answer the decider expects to its move, or INVALID_MOVE
+    transposition_table* table; // for the searching deciders, the shared search_table if null
+};
+
+using chess_ai_decider = move(*)(const game&, color, const move_list&, const decider_context&);
+using blocking_decider = move(*)(const game&, color, const move_list&); // with no limits, see decide()
 
 struct chess_ai {
     char name[32];
-    chess_ai_decider decider;
+    chess_ai_decider decider; // one of these two is null
+    blocking_decider blocking;
 };
 
+void clear_board(board& b);
 void set_piece(board& b, int8_t x, int8_t y, piece p);
 piece get_piece(const board& b, int8_t x, int8_t y);
 piece make_piece(color c, kind k);
@@ -86,26 +191,45 @@ color get_color(const board& b, int8_t x, int8_t y);
 color get_color(piece p);
 
 pos pos_of(int8_t x, int8_t y);
-move move_of(int8_t src_x, int8_t src_y, int8_t dst_x, int8_t dst_y, piece p);
+move move_of(int8_t src_x, int8_t src_y, int8_t dst_x, int8_t dst_y, bool capture = false, uint8_t special = NORMAL_MOVE);
 bool is_castle(move m);
 bool is_promotion(move m);
+kind promoted_kind(move m); // INVALID_KIND unless m is a promotion
 
 bool operator==(pos a, pos b);
 bool operator!=(pos a, pos b);
-bool operator==(move a, move b);
-bool operator!=(move a, move b);
 
 bool is_targeted(const targets_set v, int8_t x, int8_t y);
 void set_targeted(targets_set& v, int8_t x, int8_t y);
+targets_set pawn_targets(color c, uint8_t sq);
+targets_set knight_targets(uint8_t sq);
+targets_set bishop_targets(uint8_t sq, pieces_set ps);
+targets_set rook_targets(uint8_t sq, pieces_set ps);
+targets_set queen_targets(uint8_t sq, pieces_set ps);
+targets_set king_targets(uint8_t sq);
+targets_set piece_targets(piece p, uint8_t sq, pieces_set ps);
 targets_set find_targeted(const board& g, pieces_set ps, color c);
 
 bool is_piece(const pieces_set v, int8_t x, int8_t y);
 void set_piece(pieces_set& v, int8_t x, int8_t y);
 void remove_piece(pieces_set& v, int8_t x, int8_t y);
+void find_sets(const board& b, board_sets& sets); // in one pass over the rows
 pieces_set find_pieces(const board& g, color c);
+pieces_set attackers_to(const game& g, uint8_t sq, pieces_set ps); // either color, as if only ps were occupied
+score static_exchange(const game& g, move m); // material won in piece_values once the captures on m's square play out
 pieces_set find_king(const board& g, color c);
+uint64_t game_key(const game& g, color c); // g.key with the side to move mixed in
 void move_piece(game& g, move m);
-void add_moves(const game& g, color c, move* moves, uint8_t& length);
+void make_move(game& g, move m, undo& u);
+void unmake_move(game& g, const undo& u);
+void add_moves(game& g, color c, move_list& list, move_filter filter = ALL_MOVES); // appends, leaving g as it found it
+void add_moves(const game& g, color c, move_list& list);
+bool is_legal(game& g, color c, move m); // for moves from elsewhere, like a hash table
+
+uint64_t perft(game& g, color c, uint8_t depth);
+// root_counts receives the count below each move, in add_moves() order
+uint64_t parallel_perft(const game& g, color c, uint8_t depth, uint8_t threads, uint32_t hash_mb, uint64_t* root_counts);
+uint64_t print_perft(game& g, color c, uint8_t depth, bool divide, uint8_t threads, uint32_t hash_mb); // prints node count, time and speed
 
 score get_score(const game& b, color c);
 void update_game_state(game& g);
@@ -114,8 +238,39 @@ void empty_game(game& g);
 void setup_game(game& g);
 void print_game(const game& g);
 
+color color_from_string(const char* color_name);
+kind kind_from_string(const char* kind_name);
+pos pos_from_string(const char* pos_string);
+void move_to_string(move m, char* buffer); // coordinate notation, e.g. "e2e4" or "e7e8q"
+move move_from_string(game& g, color c, const char* move_string); // INVALID_MOVE unless legal
+void move_to_san(game& g, move m, char* buffer); // standard algebraic notation, e.g. "Nbd7" or "exd8=Q+"
+move move_from_san(game& g, color c, const char* san); // also takes coordinate notation
+color game_from_fen(game& g, const char* fen); // returns the side to move, INVALID_COLOR if fen doesn't parse or can't happen
+void game_to_fen(const game& g, color c, char* buffer); // at least MAX_FEN long
+
+void seed_random(uint64_t seed); // for the calling thread only
+uint32_t random_number(); // from the calling thread's generator
+
+// settings for the searching AIs, changed with 'set' in cmd_loop()
+extern uint32_t search_time_ms; // budget per move
+extern uint32_t search_hash_mb; // transposition table size
+extern uint8_t search_threads;
+extern bool search_huge_pages;
+extern bool search_ponder; // keep searching on the human's time in 'play'
+
+uint64_t monotonic_ms();
+decider_context context_for(uint32_t ms); // a deadline ms from now, no other limit
+
 void add_ai(const char* name, chess_ai_decider decider);
+void add_ai(const char* name, blocking_decider decider);
 const chess_ai* find_ai(const char* name);
+// one of moves, which can't be empty; with limits, a blocking decider runs on a thread of
+// its own, and once they run out decide() waits for the move it answers with
+move decide(const chess_ai& ai, const game& g, color c, const move_list& moves, const decider_context& context);
+// true once a blocking decider's limits have run out: it must then answer with the best move
+// it has, as decide() waits for it
+bool decider_stopped();
+void list_ais(); // prints the registered names to stderr
 
 void cmd_loop();
 
@@ -0,0 +1,165 @@
+#include "chess.h"
+#include "search.h"
+#include "nnue.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+
+// Runs a test suite in EPD format: a FEN without the move counters, then operations like
+// 'bm Nf3; id "name";'. A position is solved when the search picks one of its best moves
+// (bm), or avoids all of its bad ones (am). Positions are shared out between threads.
+struct epd_job {
+    FILE* file;
+    pthread_mutex_t lock; // for reading the file and printing
+    search_limits limits;
+    uint32_t line, positions, tested, solved;
+    uint64_t nodes;
+};
+
+// copies the text after op (e.g. "bm") up to the next ';' into buffer, or returns false
+static bool find_operation(const char* ops, const char* op, char* buffer, size_t size) {
+    size_t length = strlen(op);
+    for (const char* reader = ops; (reader = strstr(reader, op)); reader += length) {
+        bool starts = reader == ops || reader[-1] == ' ' || reader[-1] == ';';
+        if (!starts || reader[length] != ' ') continue;
+        reader += length + 1;
+        size_t end = strcspn(reader, ";\r\n");
+        if (end >= size) end = size - 1;
+        strncpy(buffer, reader, end);
+        buffer[end] = '\0';
+        return true;
+    }
+    return false;
+}
+
+// whether move m, named in SAN, is in a space-separated list of moves
+static bool in_move_list(game& g, color c, move m, char* list) {
+    char* rest = nullptr;
+    for (const char* name = strtok_r(list, " ", &rest); name; name = strtok_r(nullptr, " ", &rest)) {
+        if (move_from_san(g, c, name) == m) return true;
+    }
+    return false;
+}
+
+static void run_position(epd_job& job, char* line, uint32_t number) {
+    // the first four fields are a FEN without the move counters
+    char* ops = line;
+    for (uint8_t fields = 0; *ops && fields < 4; fields ++) {
+        while (*ops == ' ') ops ++;
+        while (*ops && *ops != ' ') ops ++;
+    }
+    char fen[MAX_FEN + 16];
+    snprintf(fen, sizeof(fen), "%.*s 0 1", int(ops - line), line);
+    game g;
+    color c = game_from_fen(g, fen);
+    if (c == INVALID_COLOR) {
+        pthread_mutex_lock(&job.lock);
+        fprintf(stderr, "Line %u: could not read the position.\n", number);
+        pthread_mutex_unlock(&job.lock);
+        return;
+    }
+
+    char id[64], best_moves[128], avoid_moves[128];
+    if (!find_operation(ops, "id", id, sizeof(id))) snprintf(id, sizeof(id), "line %u", number);
+    else if (id[0] == '"') { // drop the quotes
+        size_t end = strcspn(id + 1, "\"");
+        memmove(id, id + 1, end);
+        id[end] = '\0';
+    }
+    bool has_best = find_operation(ops, "bm", best_moves, sizeof(best_moves));
+    bool has_avoid = find_operation(ops, "am", avoid_moves, sizeof(avoid_moves));
+
+    move_list list;
+    add_moves(g, c, list);
+    search_result result = search(g, c, list, job.limits);
+    char name[16] = "(none)";
+    if (list.length) move_to_san(g, result.best, name);
+    bool tested = has_best || has_avoid;
+    bool solved = list.length && tested;
+    if (has_best && solved) solved = in_move_list(g, c, result.best, best_moves);
+    if (has_avoid && solved) solved = !in_move_list(g, c, result.best, avoid_moves);
+
+    pthread_mutex_lock(&job.lock);
+    if (has_best) find_operation(ops, "bm", best_moves, sizeof(best_moves)); // strtok_r cut them up
+    printf("%-24s %-6s %-8s depth %-3u nodes %-10llu%s%s\n", id, !tested ? "-" : solved ? "ok" : "FAIL", name, result.depth,
+        (unsigned long long)result.nodes, has_best ? " bm " : "", has_best ? best_moves : "");
+    job.positions ++;
+    job.tested += tested;
+    job.solved += solved;
+    job.nodes += result.nodes;
+    pthread_mutex_unlock(&job.lock);
+}
+
+static void* run_worker(void* arg) {
+    epd_job& job = *(epd_job*)arg;
+    char line[1024];
+    while (true) {
+        pthread_mutex_lock(&job.lock);
+        bool more = fgets(line, sizeof(line), job.file);
+        uint32_t number = ++ job.line;
+        pthread_mutex_unlock(&job.lock);
+        if (!more) return nullptr;
+        if (line[strspn(line, " \t\r\n")] && line[0] != '#') run_position(job, line, number);
+    }
+}
+
+int main(int argc, char** argv) {
+    // epd <file> [depth <n>] [nodes <n>] [threads <n>] [hash <mb>] [network <file>]
+    const char* path = argc > 1 ? argv[1] : nullptr;
+    const char* network = nullptr;
+    long depth = 0, nodes = 0, threads = 1, hash_mb = 64;
+    bool ok = path;
+    for (int i = 2; i < argc && ok; i ++) {
+        ok = i + 1 < argc;
+        long value = ok ? atol(argv[i + 1]) : -1;
+        if (!strcmp(argv[i], "network")) network = argv[i + 1];
+        else if (!strcmp(argv[i], "depth")) depth = value;
+        else if (!strcmp(argv[i], "nodes")) nodes = value;
+        else if (!strcmp(argv[i], "threads")) threads = value;
+        else if (!strcmp(argv[i], "hash")) hash_mb = value;
+        else ok = false;
+        i ++;
+    }
+    if (!ok || depth < 0 || depth > MAX_PLY || nodes < 0 || threads < 1 || threads > 255 || hash_mb < 0) {
+        fprintf(stderr, "Usage: %s <file> [depth <n>] [nodes <n>] [threads <n>] [hash <mb>] [network <file>]\n", argv[0]);
+        fprintf(stderr, "Searches every position in the file, one per thread at a time, to depth 6 unless told otherwise.\n");
+        return 1;
+    }
+    if (network && !load_network(network)) {
+        fprintf(stderr, "Could not load the network '%s'.\n", network);
+        return 1;
+    }
+    if (!depth && !nodes) depth = 6;
+
+    epd_job job = {};
+    job.file = fopen(path, "r");
+    if (!job.file) {
+        fprintf(stderr, "Could not open '%s'.\n", path);
+        return 1;
+    }
+    pthread_mutex_init(&job.lock, nullptr);
+    job.limits = { 0, uint64_t(nodes), uint8_t(depth), 1, nullptr, nullptr, nullptr };
+    search_hash_mb = hash_mb; // every position shares the one table
+    resize_table(search_table, search_hash_mb, search_huge_pages);
+
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t* workers = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    bool* running = (bool*)calloc(threads, sizeof(bool));
+    for (long i = 1; i < threads; i ++) running[i] = !pthread_create(workers + i, nullptr, run_worker, &job);
+    run_worker(&job);
+    for (long i = 1; i < threads; i ++) if (running[i]) pthread_join(workers[i], nullptr);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(running);
+    free(workers);
+    fclose(job.file);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Solved: %u of %u (%.1f%%), %u positions searched\n", job.solved, job.tested,
+        job.tested ? 100.0 * job.solved / job.tested : 0.0, job.positions);
+    printf("Nodes: %llu\n", (unsigned long long)job.nodes);
+    printf("Time: %.3fs (%.0f nodes/s)\n", seconds, seconds > 0 ? job.nodes / seconds : 0.0);
+    return 0;
+}
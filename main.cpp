@@ -1,9 +1,64 @@
 #include "chess.h"
 #include "ai.hpp"
+#include "search.h"
+#include "uci.h"
+#include "match.h"
+#include "server.h"
+#include "nnue.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// main --match <ai1> <ai2> <games> <threads> [time <ms>] [sprt <elo0> <elo1>]
+static int match(int argc, char** argv) {
+    match_settings settings = {};
+    settings.opening_plies = 8;
+    if (argc >= 6) {
+        settings.first = find_ai(argv[2]), settings.second = find_ai(argv[3]);
+        settings.games = atoi(argv[4]);
+        settings.threads = atoi(argv[5]) > 0 && atoi(argv[5]) < 256 ? atoi(argv[5]) : 0;
+    }
+    for (int i = 6; i < argc && settings.games; i ++) {
+        if (!strcmp(argv[i], "time") && i + 1 < argc && atoi(argv[i + 1]) > 0) search_time_ms = atoi(argv[++ i]);
+        else if (!strcmp(argv[i], "sprt") && i + 2 < argc) {
+            settings.sprt = true;
+            settings.elo0 = atof(argv[i + 1]), settings.elo1 = atof(argv[i + 2]);
+            i += 2;
+        }
+        else settings.games = 0;
+    }
+    if (!run_match(settings)) {
+        fprintf(stderr, "Usage: %s --match <ai1> <ai2> <games> <threads> [time <ms>] [sprt <elo0> <elo1>]\n", argv[0]);
+        list_ais();
+        return 1;
+    }
+    return 0;
+}
+
+// main --server <socket> <threads> <games> [time <ms>]
+static int serve(int argc, char** argv) {
+    server_settings settings = {};
+    if (argc == 5 || (argc == 7 && !strcmp(argv[5], "time") && atoi(argv[6]) > 0)) {
+        settings.path = argv[2];
+        settings.threads = atoi(argv[3]) > 0 && atoi(argv[3]) < 256 ? atoi(argv[3]) : 0;
+        settings.sessions = atoi(argv[4]) > 0 ? atoi(argv[4]) : 0;
+        if (argc == 7) search_time_ms = atoi(argv[6]);
+    }
+    if (!run_server(settings)) {
+        fprintf(stderr, "Usage: %s --server <socket> <threads> <games> [time <ms>]\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}
 
 int main(int argc, char** argv) {
     add_ai("random", random);
     add_ai("min_oppt_moves", min_opponent_moves);
-    cmd_loop();
+    add_ai("alpha_beta", alpha_beta);
+    load_network(DEFAULT_NETWORK); // the built-in evaluation otherwise
+    if (argc > 1 && !strcmp(argv[1], "--uci")) uci_loop(); // for GUIs and tournament managers
+    else if (argc > 1 && !strcmp(argv[1], "--match")) return match(argc, argv);
+    else if (argc > 1 && !strcmp(argv[1], "--server")) return serve(argc, argv); // many games, over a socket
+    else cmd_loop();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,204 @@
+#include "chess.h"
+#include "book.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Builds an opening book from PGN games. Each position reached in the first plies of a game
+// gets the move played in it, weighted by how the side that played it did: 2 for a win, 1 for
+// a draw. Games stop counting at the first move this engine can't play, like en passant.
+struct book_record {
+    uint64_t key;
+    uint16_t move;
+    uint32_t games, points;
+};
+
+struct book_builder {
+    book_record* records;
+    uint64_t length, capacity;
+    uint8_t max_plies;
+
+    // the game being read
+    game g;
+    color c;
+    uint16_t plies;
+    bool playing; // false once a move didn't parse, or past max_plies
+    book_record played[256];
+    color movers[256];
+    uint8_t played_length;
+    int8_t result; // 1 if white won, -1 if black won, 0 for a draw, 2 if unknown
+};
+
+static void start_game(book_builder& bb) {
+    setup_game(bb.g);
+    bb.c = WHITE;
+    bb.plies = bb.played_length = 0;
+    bb.playing = true;
+    bb.result = 2;
+}
+
+static void end_game(book_builder& bb) {
+    if (bb.result != 2) {
+        for (uint8_t i = 0; i < bb.played_length; i ++) {
+            if (bb.length == bb.capacity) {
+                bb.capacity = bb.capacity ? bb.capacity * 2 : 1 << 16;
+                bb.records = (book_record*)realloc(bb.records, bb.capacity * sizeof(book_record));
+            }
+            book_record r = bb.played[i];
+            r.games = 1;
+            r.points = (bb.movers[i] == WHITE ? bb.result : -bb.result) + 1;
+            bb.records[bb.length ++] = r;
+        }
+    }
+    start_game(bb);
+}
+
+static void play_token(book_builder& bb, const char* token) {
+    if (!strcmp(token, "1-0") || !strcmp(token, "0-1") || !strcmp(token, "1/2-1/2") || !strcmp(token, "*")) {
+        bb.result = token[0] == '*' ? 2 : token[1] == '/' ? 0 : token[0] == '1' ? 1 : -1;
+        end_game(bb);
+        return;
+    }
+    if (token[0] == '$' || !bb.playing) return; // annotation glyph
+    if (token[0] >= '1' && token[0] <= '9') { // move number, maybe run into the move
+        while ((*token >= '0' && *token <= '9') || *token == '.') token ++;
+        if (!*token) return;
+    }
+    move m = move_from_san(bb.g, bb.c, token);
+    if (m == INVALID_MOVE) {
+        bb.playing = false;
+        return;
+    }
+    bb.movers[bb.played_length] = bb.c;
+    bb.played[bb.played_length ++] = { polyglot_key(bb.g, bb.c), book_move(m), 0, 0 };
+    move_piece(bb.g, m);
+    bb.c = bb.c == WHITE ? BLACK : WHITE;
+    bb.playing = ++ bb.plies < bb.max_plies;
+}
+
+// reads the tags the book cares about: a starting position, and the result in case the
+// movetext doesn't end with one
+static void read_tag(book_builder& bb, const char* line) {
+    char name[32], value[128];
+    if (sscanf(line, "[%31s \"%127[^\"]\"]", name, value) != 2) return;
+    if (!strcmp(name, "Result")) {
+        bb.result = !strcmp(value, "1-0") ? 1 : !strcmp(value, "0-1") ? -1 : !strcmp(value, "1/2-1/2") ? 0 : 2;
+    }
+    else if (!strcmp(name, "FEN")) {
+        bb.c = game_from_fen(bb.g, value);
+        if (bb.c == INVALID_COLOR) bb.playing = false, bb.c = WHITE;
+    }
+}
+
+static int compare_records(const void* a, const void* b) {
+    const book_record& x = *(const book_record*)a;
+    const book_record& y = *(const book_record*)b;
+    if (x.key != y.key) return x.key < y.key ? -1 : 1;
+    return x.move < y.move ? -1 : x.move > y.move;
+}
+
+static void write_big_endian(uint8_t* bytes, uint64_t value, uint8_t size) {
+    for (uint8_t i = size; i --;) bytes[i] = value & 255, value >>= 8;
+}
+
+int main(int argc, char** argv) {
+    // makebook <pgn> <book> [plies <n>] [min <games>]
+    int plies = 20, min_games = 1;
+    bool ok = argc >= 3;
+    for (int i = 3; i < argc && ok; i ++) {
+        if (!strcmp(argv[i], "plies") && i + 1 < argc) plies = atoi(argv[++ i]);
+        else if (!strcmp(argv[i], "min") && i + 1 < argc) min_games = atoi(argv[++ i]);
+        else ok = false;
+    }
+    if (!ok || plies < 1 || plies > 255 || min_games < 1) {
+        fprintf(stderr, "Usage: %s <pgn> <book> [plies <n>] [min <games>]\n", argv[0]);
+        fprintf(stderr, "Keeps the first n plies of each game (20 by default), and moves played in at least min games.\n");
+        return 1;
+    }
+    FILE* pgn = fopen(argv[1], "r");
+    if (!pgn) {
+        fprintf(stderr, "Could not open '%s'.\n", argv[1]);
+        return 1;
+    }
+
+    book_builder bb = {};
+    bb.max_plies = plies;
+    start_game(bb);
+    uint32_t games = 0;
+    uint8_t comment_depth = 0, variation_depth = 0; // {comments} don't nest, (variations) do
+    bool in_movetext = false;
+    char line[4096];
+    while (fgets(line, sizeof(line), pgn)) {
+        if (!comment_depth && line[0] == '[') {
+            if (in_movetext) end_game(bb), in_movetext = false; // the last game had no result
+            if (!strncmp(line, "[Event ", 7)) games ++;
+            read_tag(bb, line);
+            continue;
+        }
+        if (line[0] == '%') continue; // escaped line
+        char token[64];
+        uint8_t length = 0;
+        for (const char* reader = line; ; reader ++) {
+            char ch = *reader;
+            bool separator = !ch || ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n'
+                || ch == '{' || ch == '}' || ch == '(' || ch == ')' || ch == ';';
+            if (separator && length) {
+                token[length] = '\0';
+                play_token(bb, token);
+                in_movetext = bb.plies || bb.played_length;
+                length = 0;
+            }
+            if (!ch) break;
+            if (comment_depth) comment_depth = ch != '}';
+            else if (ch == '{') comment_depth = 1;
+            else if (ch == ';') break; // comment to the end of the line
+            else if (ch == '(') variation_depth ++;
+            else if (ch == ')') variation_depth -= variation_depth > 0;
+            else if (!separator && !variation_depth && length < sizeof(token) - 1) token[length ++] = ch;
+        }
+    }
+    if (in_movetext) end_game(bb);
+    fclose(pgn);
+
+    // merge the moves played in the same position
+    qsort(bb.records, bb.length, sizeof(book_record), compare_records);
+    uint64_t merged = 0;
+    for (uint64_t i = 0; i < bb.length; i ++) {
+        if (merged && bb.records[merged - 1].key == bb.records[i].key && bb.records[merged - 1].move == bb.records[i].move) {
+            bb.records[merged - 1].games += bb.records[i].games;
+            bb.records[merged - 1].points += bb.records[i].points;
+        }
+        else bb.records[merged ++] = bb.records[i];
+    }
+
+    FILE* out = fopen(argv[2], "wb");
+    if (!out) {
+        fprintf(stderr, "Could not create '%s'.\n", argv[2]);
+        return 1;
+    }
+    uint64_t entries = 0, positions = 0;
+    for (uint64_t start = 0, end; start < merged; start = end) {
+        uint32_t most = 0; // weights are 16 bits, so scale each position's down to fit
+        for (end = start; end < merged && bb.records[end].key == bb.records[start].key; end ++) {
+            if (bb.records[end].games >= uint32_t(min_games) && bb.records[end].points > most) most = bb.records[end].points;
+        }
+        if (!most) continue;
+        positions ++;
+        for (uint64_t i = start; i < end; i ++) {
+            const book_record& r = bb.records[i];
+            uint32_t weight = most > 65535 ? uint64_t(r.points) * 65535 / most : r.points;
+            if (r.games < uint32_t(min_games) || !weight) continue;
+            uint8_t entry[16] = {};
+            write_big_endian(entry, r.key, 8);
+            write_big_endian(entry + 8, r.move, 2);
+            write_big_endian(entry + 10, weight, 2);
+            fwrite(entry, sizeof(entry), 1, out);
+            entries ++;
+        }
+    }
+    fclose(out);
+    free(bb.records);
+    printf("%u games, %llu moves in %llu positions written to %s.\n", games, (unsigned long long)entries,
+        (unsigned long long)positions, argv[2]);
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include "match.h"
+#include "search.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <pthread.h>
+
+#define MAX_GAME_PLIES 400 // adjudicated a draw after that
+
+enum game_end : uint8_t {
+    CHECKMATE,
+    STALEMATE,
+    FIFTY_MOVES,
+    REPETITION,
+    NO_MATERIAL,
+    MOVE_LIMIT,
+    ILLEGAL_MOVE
+};
+
+static const char* end_names[] = {
+    "checkmate", "stalemate", "fifty-move rule", "threefold repetition", "insufficient material", "move limit", "illegal move"
+};
+
+struct game_record {
+    int8_t result; // 1 if white won, -1 if black won, 0 for a draw
+    game_end end;
+    uint16_t plies;
+};
+
+struct match_state {
+    const match_settings* settings;
+    uint64_t seed;
+    pthread_mutex_t lock; // for everything below
+    uint32_t next_game, played;
+    uint32_t wins, losses, draws; // for the first AI
+    bool stopped;
+};
+
+// neither side can mate with a lone minor piece at most
+static bool no_material(const game& g) {
+    return !(g.pawns | g.rooks | g.queens) && __builtin_popcountll(g.knights | g.bishops) <= 1;
+}
+
+// tables[0] is white's and tables[1] black's, emptied first so neither side sees the other's
+// analysis or anything from an earlier game
+static game_record play_game(const chess_ai* white, const chess_ai* black, transposition_table* tables, uint8_t opening_plies,
+    uint64_t opening_seed, uint64_t seed) {
+    clear_table(tables[0]);
+    clear_table(tables[1]);
+    game g;
+    setup_game(g);
+    color c = WHITE;
+    move_list list;
+
+    seed_random(opening_seed); // both games of a pair start the same way
+    for (uint8_t i = 0; i < opening_plies; i ++) {
+        list.length = 0;
+        add_moves(g, c, list);
+        if (!list.length) break;
+        move_piece(g, list.moves[random_number() % list.length]);
+        c = c == WHITE ? BLACK : WHITE;
+    }
+    seed_random(seed);
+
+    uint64_t keys[MAX_GAME_PLIES + 1];
+    uint16_t plies = 0;
+    keys[0] = game_key(g, c);
+    while (true) {
+        list.length = 0;
+        add_moves(g, c, list);
+        bool in_check = c == WHITE ? g.white_in_check : g.black_in_check;
+        if (!list.length) return { int8_t(!in_check ? 0 : c == WHITE ? -1 : 1), in_check ? CHECKMATE : STALEMATE, plies };
+        if (g.halfmove_clock >= 100) return { 0, FIFTY_MOVES, plies };
+        if (no_material(g)) return { 0, NO_MATERIAL, plies };
+        uint8_t repeats = 0; // nothing before the last capture or pawn move can come back
+        for (int32_t i = int32_t(plies) - 2; i >= 0 && i >= int32_t(plies) - g.halfmove_clock; i -= 2) repeats += keys[i] == keys[plies];
+        if (repeats >= 2) return { 0, REPETITION, plies };
+        if (plies == MAX_GAME_PLIES) return { 0, MOVE_LIMIT, plies };
+
+        decider_context context = context_for(search_time_ms);
+        context.table = tables + (c == BLACK);
+        move m = decide(*(c == WHITE ? white : black), g, c, list, context);
+        bool legal = false;
+        for (uint16_t i = 0; i < list.length && !legal; i ++) legal = list.moves[i] == m;
+        if (!legal) return { int8_t(c == WHITE ? -1 : 1), ILLEGAL_MOVE, plies };
+        move_piece(g, m);
+        c = c == WHITE ? BLACK : WHITE;
+        keys[++ plies] = game_key(g, c);
+    }
+}
+
+static double elo_from_score(double score) {
+    return -400 * log10(1 / score - 1);
+}
+
+// mean score per game and its variance, for the first AI
+static void score_stats(uint32_t wins, uint32_t losses, uint32_t draws, double& mean, double& variance) {
+    double n = wins + losses + draws;
+    mean = (wins + draws / 2.0) / n;
+    variance = (wins * (1 - mean) * (1 - mean) + draws * (0.5 - mean) * (0.5 - mean) + losses * mean * mean) / n;
+}
+
+// log-likelihood ratio of elo1 over elo0, using the normal approximation of the score
+static double sprt_llr(uint32_t wins, uint32_t losses, uint32_t draws, double elo0, double elo1) {
+    double mean, variance;
+    score_stats(wins, losses, draws, mean, variance);
+    if (variance <= 0) return 0;
+    double s0 = 1 / (1 + pow(10, -elo0 / 400)), s1 = 1 / (1 + pow(10, -elo1 / 400));
+    return (s1 - s0) * (2 * mean - s0 - s1) / (2 * variance / (wins + losses + draws));
+}
+
+static void print_elo(uint32_t wins, uint32_t losses, uint32_t draws) {
+    double mean, variance;
+    score_stats(wins, losses, draws, mean, variance);
+    if (mean <= 0 || mean >= 1) {
+        printf("Elo difference: %sinf\n", mean <= 0 ? "-" : "+");
+        return;
+    }
+    double margin = 1.96 * sqrt(variance / (wins + losses + draws)); // 95%
+    double low = mean - margin > 0 ? elo_from_score(mean - margin) : -INFINITY;
+    double high = mean + margin < 1 ? elo_from_score(mean + margin) : INFINITY;
+    printf("Elo difference: %.1f +/- %.1f (95%%: %.1f to %.1f)\n", elo_from_score(mean), (high - low) / 2, low, high);
+}
+
+static void* run_games(void* arg) {
+    match_state& st = *(match_state*)arg;
+    const match_settings& ms = *st.settings;
+    const double lower = log(0.05 / 0.95), upper = log(0.95 / 0.05); // 5% chance of either kind of wrong call
+    transposition_table tables[2] = {};
+    resize_table(tables[0], search_hash_mb, search_huge_pages);
+    resize_table(tables[1], search_hash_mb, search_huge_pages);
+    while (true) {
+        pthread_mutex_lock(&st.lock);
+        uint32_t index = st.next_game ++;
+        bool done = st.stopped || index >= ms.games;
+        pthread_mutex_unlock(&st.lock);
+        if (done) {
+            free_table(tables[0]);
+            free_table(tables[1]);
+            return nullptr;
+        }
+
+        bool first_white = index % 2 == 0;
+        const chess_ai* white = first_white ? ms.first : ms.second;
+        const chess_ai* black = first_white ? ms.second : ms.first;
+        game_record r = play_game(white, black, tables, ms.opening_plies, st.seed ^ (index / 2 + 1) * 0x9e3779b97f4a7c15ull,
+            st.seed ^ (index + 1) * 0xc2b2ae3d27d4eb4full);
+        int8_t result = first_white ? r.result : -r.result;
+
+        pthread_mutex_lock(&st.lock);
+        if (!st.stopped) {
+            st.played ++;
+            if (result > 0) st.wins ++;
+            else if (result < 0) st.losses ++;
+            else st.draws ++;
+            printf("Game %u: %s vs %s, %s (%s after %u moves)\tScore +%u -%u =%u\n", index + 1, white->name, black->name,
+                r.result > 0 ? "1-0" : r.result < 0 ? "0-1" : "1/2-1/2", end_names[r.end], (r.plies + 1) / 2,
+                st.wins, st.losses, st.draws);
+            if (ms.sprt) {
+                double llr = sprt_llr(st.wins, st.losses, st.draws, ms.elo0, ms.elo1);
+                if (llr <= lower || llr >= upper) {
+                    printf("SPRT: LLR %.2f (%.2f, %.2f), %s accepted\n", llr, lower, upper, llr >= upper ? "H1" : "H0");
+                    st.stopped = true;
+                }
+            }
+            fflush(stdout);
+        }
+        pthread_mutex_unlock(&st.lock);
+    }
+}
+
+bool run_match(const match_settings& settings) {
+    if (!settings.first || !settings.second || !settings.games || !settings.threads) return false;
+    match_state st = {};
+    st.settings = &settings;
+    st.seed = time(0);
+    pthread_mutex_init(&st.lock, nullptr);
+
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t* threads = (pthread_t*)malloc(settings.threads * sizeof(pthread_t));
+    uint8_t started = 1;
+    for (; started < settings.threads; started ++) {
+        if (pthread_create(threads + started, nullptr, run_games, &st)) break;
+    }
+    run_games(&st);
+    for (uint8_t i = 1; i < started; i ++) pthread_join(threads[i], nullptr);
+    free(threads);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("\n%s vs %s: +%u -%u =%u in %u games, %.1fs\n", settings.first->name, settings.second->name,
+        st.wins, st.losses, st.draws, st.played, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    if (st.played) print_elo(st.wins, st.losses, st.draws);
+    if (settings.sprt) {
+        printf("SPRT: LLR %.2f for elo0 %.1f, elo1 %.1f\n", st.played ? sprt_llr(st.wins, st.losses, st.draws, settings.elo0, settings.elo1) : 0.0,
+            settings.elo0, settings.elo1);
+    }
+    return true;
+}
@@ -0,0 +1,20 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include "chess.h"
+
+struct match_settings {
+    const chess_ai* first;
+    const chess_ai* second;
+    uint32_t games; // played in pairs from the same opening, the AIs swapping colors
+    uint8_t threads; // games played at once, both sides of each searching their own table
+    uint8_t opening_plies; // random moves played before the AIs take over
+    bool sprt; // stop once the result is clear either way
+    double elo0, elo1; // the SPRT hypotheses: first is elo0 or elo1 stronger than second
+};
+
+// plays the games without a board on screen, printing each result as it comes in and the
+// Elo difference at the end; returns false if the games couldn't be started
+bool run_match(const match_settings& settings);
+
+#endif
@@ -0,0 +1,158 @@
+#include "nnue.h"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define NNUE_FEATURES 768
+#define NNUE_VERSION 1
+
+struct network {
+    const int16_t* feature_weights; // in the mapped file
+    const int16_t* feature_biases;
+    const int8_t* output_weights;
+    int32_t output_bias, divisor;
+    const void* data;
+    uint64_t bytes;
+};
+
+static network net = {};
+uint32_t network_id = 0;
+static uint32_t networks_loaded = 0;
+static const int16_t zero_row[NNUE_HIDDEN] = {}; // the weights of an empty square
+
+// the weights for p on sq, as seen by one side: its own pieces first, and its back rank at the bottom
+static const int16_t* feature_row(uint8_t side, piece p, uint8_t sq) {
+    if (!p) return zero_row;
+    uint8_t theirs = (get_color(p) == WHITE) != (side == 0);
+    uint32_t feature = (theirs * 6 + get_kind(p) - PAWN) * 64 + (side ? sq ^ 56 : sq);
+    return net.feature_weights + feature * NNUE_HIDDEN;
+}
+
+#if defined(__AVX2__)
+static void update_row(int16_t* values, const int16_t* plus, const int16_t* minus) {
+    for (uint32_t i = 0; i < NNUE_HIDDEN; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(values + i));
+        v = _mm256_add_epi16(v, _mm256_loadu_si256((const __m256i*)(plus + i)));
+        v = _mm256_sub_epi16(v, _mm256_loadu_si256((const __m256i*)(minus + i)));
+        _mm256_storeu_si256((__m256i*)(values + i), v);
+    }
+}
+
+static int32_t output_sum(const int16_t* values, const int8_t* weights) {
+    __m256i sum = _mm256_setzero_si256(), low = _mm256_setzero_si256(), high = _mm256_set1_epi16(127);
+    for (uint32_t i = 0; i < NNUE_HIDDEN; i += 16) {
+        __m256i v = _mm256_min_epi16(_mm256_max_epi16(_mm256_loadu_si256((const __m256i*)(values + i)), low), high);
+        __m256i w = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(weights + i)));
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(v, w));
+    }
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1));
+    return _mm_cvtsi128_si32(half);
+}
+#elif defined(__SSE2__)
+static void update_row(int16_t* values, const int16_t* plus, const int16_t* minus) {
+    for (uint32_t i = 0; i < NNUE_HIDDEN; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(values + i));
+        v = _mm_add_epi16(v, _mm_loadu_si128((const __m128i*)(plus + i)));
+        v = _mm_sub_epi16(v, _mm_loadu_si128((const __m128i*)(minus + i)));
+        _mm_storeu_si128((__m128i*)(values + i), v);
+    }
+}
+
+static int32_t output_sum(const int16_t* values, const int8_t* weights) {
+    __m128i sum = _mm_setzero_si128(), low = _mm_setzero_si128(), high = _mm_set1_epi16(127);
+    for (uint32_t i = 0; i < NNUE_HIDDEN; i += 8) {
+        __m128i v = _mm_min_epi16(_mm_max_epi16(_mm_loadu_si128((const __m128i*)(values + i)), low), high);
+        __m128i w = _mm_loadl_epi64((const __m128i*)(weights + i));
+        w = _mm_srai_epi16(_mm_unpacklo_epi8(w, w), 8); // sign extended to 16 bits
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(v, w));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+    return _mm_cvtsi128_si32(sum);
+}
+#else
+static void update_row(int16_t* values, const int16_t* plus, const int16_t* minus) {
+    for (uint32_t i = 0; i < NNUE_HIDDEN; i ++) values[i] += plus[i] - minus[i];
+}
+
+static int32_t output_sum(const int16_t* values, const int8_t* weights) {
+    int32_t sum = 0;
+    for (uint32_t i = 0; i < NNUE_HIDDEN; i ++) sum += (values[i] < 0 ? 0 : values[i] > 127 ? 127 : values[i]) * weights[i];
+    return sum;
+}
+#endif
+
+bool load_network(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    const uint64_t bytes = sizeof(network_header) + (NNUE_FEATURES + 1) * NNUE_HIDDEN * sizeof(int16_t) + 2 * NNUE_HIDDEN;
+    void* data = MAP_FAILED;
+    if (!fstat(fd, &st) && uint64_t(st.st_size) == bytes) data = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (data == MAP_FAILED) return false;
+    const network_header& header = *(const network_header*)data;
+    if (memcmp(header.magic, "MKNN", 4) || header.version != NNUE_VERSION || header.features != NNUE_FEATURES
+        || header.hidden != NNUE_HIDDEN || header.divisor <= 0) {
+        munmap(data, bytes);
+        return false;
+    }
+
+    unload_network();
+    net.data = data, net.bytes = bytes;
+    net.feature_weights = (const int16_t*)((const uint8_t*)data + sizeof(network_header));
+    net.feature_biases = net.feature_weights + NNUE_FEATURES * NNUE_HIDDEN;
+    net.output_weights = (const int8_t*)(net.feature_biases + NNUE_HIDDEN);
+    net.output_bias = header.output_bias, net.divisor = header.divisor;
+    network_id = ++ networks_loaded; // accumulators from an older network are stale
+    return true;
+}
+
+void unload_network() {
+    if (net.data) munmap((void*)net.data, net.bytes);
+    net = {};
+    network_id = 0;
+}
+
+void refresh_accumulator(const game& g, accumulator& acc) {
+    for (uint8_t side = 0; side < 2; side ++) {
+        memcpy(acc.values[side], net.feature_biases, sizeof(acc.values[side]));
+        for (pieces_set rest = g.pieces; rest; rest &= rest - 1) {
+            uint8_t sq = __builtin_ctzll(rest);
+            update_row(acc.values[side], feature_row(side, get_piece(g.b, sq % 8, sq / 8), sq), zero_row);
+        }
+    }
+}
+
+void move_accumulator(const game& g, move m, const accumulator& before, accumulator& after) {
+    uint8_t src = m.src_y * 8 + m.src_x, dst = m.dst_y * 8 + m.dst_x;
+    piece p = get_piece(g.b, m.src_x, m.src_y), captured = get_piece(g.b, m.dst_x, m.dst_y);
+    piece placed = is_promotion(m) ? make_piece(get_color(p), promoted_kind(m)) : p;
+    piece rook = make_piece(get_color(p), ROOK);
+    uint8_t rook_src = m.src_y * 8 + (m.dst_x > m.src_x ? 7 : 0), rook_dst = (src + dst) / 2; // castling only
+    for (uint8_t side = 0; side < 2; side ++) {
+        memcpy(after.values[side], before.values[side], sizeof(after.values[side]));
+        update_row(after.values[side], zero_row, feature_row(side, p, src));
+        update_row(after.values[side], feature_row(side, placed, dst), feature_row(side, captured, dst));
+        if (is_castle(m)) update_row(after.values[side], feature_row(side, rook, rook_dst), feature_row(side, rook, rook_src));
+    }
+}
+
+score network_score(const accumulator& acc, color c) {
+    uint8_t us = c == WHITE ? 0 : 1;
+    int32_t sum = output_sum(acc.values[us], net.output_weights) + output_sum(acc.values[!us], net.output_weights + NNUE_HIDDEN);
+    return (sum + net.output_bias) / net.divisor;
+}
+
+score network_score(const game& g, color c) {
+    accumulator acc;
+    refresh_accumulator(g, acc);
+    return network_score(acc, c);
+}
@@ -0,0 +1,41 @@
+#ifndef NNUE_H
+#define NNUE_H
+
+#include "chess.h"
+
+// An efficiently updatable network: 768 inputs, one per piece on each square, feed an
+// accumulator of NNUE_HIDDEN values for each side's point of view, updated move by move.
+// Both accumulators are clipped to 0..127 and weighted into a single output, the side to
+// move's first. They're kept out of game, so copies of positions stay small; the search
+// keeps one per ply instead.
+//
+// The file is a network_header, then int16 feature weights [768][NNUE_HIDDEN], int16 feature
+// biases [NNUE_HIDDEN] and int8 output weights [2][NNUE_HIDDEN], all little-endian.
+struct network_header {
+    char magic[4]; // "MKNN"
+    uint32_t version;
+    uint32_t features, hidden; // 768 and NNUE_HIDDEN
+    int32_t output_bias;
+    int32_t divisor; // of the output, to get centipawns
+};
+
+#define NNUE_HIDDEN 128 // accumulator width for each side
+#define DEFAULT_NETWORK "mockfish.nnue" // loaded at startup, from the working directory, if it's there
+
+// the first layer of the network, from each side's point of view
+struct accumulator {
+    int16_t values[2][NNUE_HIDDEN]; // white's, black's
+};
+
+extern uint32_t network_id; // of the loaded network, 0 if none is
+
+bool load_network(const char* path); // maps the file, replacing any network loaded before
+void unload_network();
+// the rest need a network loaded
+void refresh_accumulator(const game& g, accumulator& acc); // from the whole board
+// after for the position m leads to, from before for g, the position m is played in
+void move_accumulator(const game& g, move m, const accumulator& before, accumulator& after);
+score network_score(const accumulator& acc, color c);
+score network_score(const game& g, color c); // from a fresh accumulator
+
+#endif
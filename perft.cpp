@@ -0,0 +1,111 @@
+#include "book.h"
+#include "chess.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Positions are given as moves played from the initial setup. The counts
+// follow this engine's rules, which have no en passant.
+struct perft_case {
+    const char* moves;
+    uint8_t depth;
+    uint64_t nodes;
+};
+
+const perft_case perft_cases[] = {
+    { "", 5, 4865351 },
+    { "e2e4 e7e5 g1f3 b8c6 f1c4 g8f6 b1c3 f8c5 d2d3 d7d6 c1g5 c8g4 d1d2 d8d7", 4, 3446986 }, // castling, pins
+    { "e2e4 d7d5 e4d5 c7c6 d5c6 d8d2 b1d2 g8f6 c6b7 e7e6", 4, 995063 }, // promotions
+    { "d2d4 e7e5 d4e5 f8b4 c2c3 b4c3 b2c3 d7d6 d1a4 e8f8", 4, 1667497 }, // lost castling rights
+};
+
+// The keys Polyglot's documentation gives for these positions. The ones it lists after
+// double pushes that could be taken en passant are left out, since this engine has no en passant.
+struct polyglot_case {
+    const char* moves;
+    uint64_t key;
+};
+
+const polyglot_case polyglot_cases[] = {
+    { "", 0x463b96181691fc9cull },
+    { "e2e4", 0x823c9b50fd114196ull },
+    { "e2e4 d7d5", 0x0756b94461c50fb0ull },
+    { "e2e4 d7d5 e4e5", 0x662fafb965db29d4ull },
+    { "e2e4 d7d5 e4e5 f7f5 e1e2", 0x652a607ca3f242c1ull },
+    { "e2e4 d7d5 e4e5 f7f5 e1e2 e8f7", 0x00fdd303c946bdd9ull },
+};
+
+// plays the moves in order from the initial setup, returning the color to move next
+color setup_moves(game& g, const char* moves) {
+    setup_game(g);
+    color c = WHITE;
+    char buffer[512];
+    strncpy(buffer, moves, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    for (const char* name = strtok(buffer, " "); name; name = strtok(nullptr, " ")) {
+        move m = move_from_string(g, c, name);
+        if (m == INVALID_MOVE) {
+            fprintf(stderr, "Illegal move '%s'.\n", name);
+            return INVALID_COLOR;
+        }
+        move_piece(g, m);
+        c = c == WHITE ? BLACK : WHITE;
+    }
+    return c;
+}
+
+int main(int argc, char** argv) {
+    // perft [<depth> [<color>] [divide]] [threads <n>] [hash <mb>]
+    int depth = 0, threads = 1, hash_mb = 0;
+    color c = WHITE;
+    bool divide = false;
+    for (int i = 1; i < argc && c != INVALID_COLOR; i ++) {
+        if (!strcmp(argv[i], "divide")) divide = true;
+        else if (!strcmp(argv[i], "threads")) threads = i + 1 < argc ? atoi(argv[++ i]) : 0;
+        else if (!strcmp(argv[i], "hash")) hash_mb = i + 1 < argc ? atoi(argv[++ i]) : -1;
+        else if (!depth && atoi(argv[i]) > 0) depth = atoi(argv[i]);
+        else c = color_from_string(argv[i]);
+    }
+    if (depth > 20 || c == INVALID_COLOR || threads < 1 || threads > 255 || hash_mb < 0) {
+        fprintf(stderr, "Usage: %s [<depth> [<color>] [divide]] [threads <n>] [hash <mb>]\n", argv[0]);
+        fprintf(stderr, "Runs the built-in test positions when no depth is given.\n");
+        return 1;
+    }
+
+    game g;
+    if (depth) {
+        setup_game(g);
+        print_perft(g, c, depth, divide, threads, hash_mb);
+        return 0;
+    }
+
+    uint64_t total = 0;
+    int failures = 0;
+    for (const perft_case& pc : perft_cases) {
+        color c = setup_moves(g, pc.moves);
+        if (c == INVALID_COLOR) return 1;
+        printf("%s\n", *pc.moves ? pc.moves : "(initial position)");
+        uint64_t nodes = print_perft(g, c, pc.depth, false, threads, hash_mb);
+        if (nodes != pc.nodes) {
+            printf("FAILED: expected %llu nodes at depth %u.\n", (unsigned long long)pc.nodes, pc.depth);
+            failures ++;
+        }
+        total += nodes;
+        printf("\n");
+    }
+    int key_failures = 0;
+    for (const polyglot_case& pc : polyglot_cases) {
+        color c = setup_moves(g, pc.moves);
+        if (c == INVALID_COLOR) return 1;
+        uint64_t key = polyglot_key(g, c);
+        if (key == pc.key) continue;
+        printf("FAILED: Polyglot key %016llx after '%s', expected %016llx.\n", (unsigned long long)key, pc.moves, (unsigned long long)pc.key);
+        key_failures ++;
+    }
+    printf("%d of %d Polyglot keys matched.\n", int(sizeof(polyglot_cases) / sizeof(polyglot_case)) - key_failures,
+        int(sizeof(polyglot_cases) / sizeof(polyglot_case)));
+    printf("%d of %d positions passed, %llu nodes total.\n",
+        int(sizeof(perft_cases) / sizeof(perft_case)) - failures, int(sizeof(perft_cases) / sizeof(perft_case)),
+        (unsigned long long)total);
+    return failures || key_failures ? 1 : 0;
+}
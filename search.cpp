@@ -0,0 +1,510 @@
+#include "search.h"
+#include "tablebase.h"
+#include "nnue.h"
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <sys/mman.h>
+
+transposition_table search_table = { nullptr, 0, 0, 0, 0, false };
+
+bool resize_table(transposition_table& t, uint32_t mb, bool huge_pages) {
+    free_table(t);
+    t.mb = mb, t.huge_pages = huge_pages;
+    uint64_t count = 1;
+    while (count * 2 * sizeof(tt_bucket) <= uint64_t(mb) << 20) count *= 2;
+    if (!mb) return true;
+
+    uint64_t bytes = count * sizeof(tt_bucket);
+    void* memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (huge_pages && bytes >= 2ull << 20) // needs pages reserved by the system, so fall back quietly
+        memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (memory == MAP_FAILED) {
+        memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) return false;
+#ifdef MADV_HUGEPAGE
+        madvise(memory, bytes, MADV_HUGEPAGE); // transparent huge pages where the kernel has them
+#endif
+    }
+    t.buckets = (tt_bucket*)memory; // zeroed by mmap
+    t.mask = count - 1, t.bytes = bytes;
+    return true;
+}
+
+void clear_table(transposition_table& t) {
+    if (t.buckets) memset(t.buckets, 0, t.bytes);
+    t.generation = 0;
+}
+
+void free_table(transposition_table& t) {
+    if (t.buckets) munmap(t.buckets, t.bytes);
+    t.buckets = nullptr;
+    t.mask = t.bytes = 0;
+    t.generation = 0;
+}
+
+// data is packed as move:16 value:32 depth:8 bound:2 generation:6
+
+bool probe_table(const transposition_table& t, uint64_t key, tt_hit& hit) {
+    if (!t.buckets) return false;
+    const tt_bucket& b = t.buckets[key & t.mask];
+    for (const tt_entry& e : b.entries) {
+        uint64_t check = __atomic_load_n(&e.check, __ATOMIC_RELAXED), data = __atomic_load_n(&e.data, __ATOMIC_RELAXED);
+        if ((check ^ data) != key || !data) continue;
+        hit.best = move_from_bits(uint16_t(data));
+        hit.value = int32_t(data >> 16);
+        hit.depth = data >> 48;
+        hit.b = bound(data >> 56 & 3);
+        return true;
+    }
+    return false;
+}
+
+void store_table(transposition_table& t, uint64_t key, move best, score value, uint8_t depth, bound b) {
+    if (!t.buckets) return;
+    tt_bucket& bucket = t.buckets[key & t.mask];
+    tt_entry* victim = nullptr;
+    int worst = 1 << 30;
+    for (tt_entry& e : bucket.entries) {
+        uint64_t check = __atomic_load_n(&e.check, __ATOMIC_RELAXED), data = __atomic_load_n(&e.data, __ATOMIC_RELAXED);
+        if (data && (check ^ data) == key) { // same position: keep a deeper result from this search, and the old move if there's no new one
+            if (best == INVALID_MOVE) best = move_from_bits(uint16_t(data));
+            if (b != EXACT_BOUND && data >> 58 == (t.generation & 63u) && uint8_t(data >> 48) > depth + 2) return;
+            victim = &e;
+            break;
+        }
+        // prefer empty slots, then ones left over from earlier searches, then shallow ones
+        int worth = !data ? -(1 << 30) : int(uint8_t(data >> 48)) - 8 * int((t.generation - (data >> 58)) & 63);
+        if (worth < worst) victim = &e, worst = worth;
+    }
+    uint64_t data = move_bits(best) | uint64_t(uint32_t(int32_t(value))) << 16 | uint64_t(depth) << 48
+        | uint64_t(b) << 56 | uint64_t(t.generation & 63) << 58;
+    __atomic_store_n(&victim->check, key ^ data, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->data, data, __ATOMIC_RELAXED);
+}
+
+// the moves of the position at one ply and the scores they are picked by
+struct ply_moves {
+    move_list list;
+    int32_t scores[MAX_MOVES];
+};
+
+// one per thread searching the position
+struct searcher {
+    game g;
+    uint64_t nodes;
+    const search_limits* limits;
+    transposition_table* table;
+    timespec start, deadline;
+    bool* stop; // shared by all threads on the search
+    bool stopped;
+    bool main; // only the main thread checks the limits, and stops the others
+    move killers[MAX_PLY][2]; // the last quiet moves to cause a cutoff at each ply
+    uint32_t history[16][64]; // how much quiet moves of each piece to each square have caused cutoffs
+    ply_moves plies[MAX_PLY]; // for the move_picker at each ply, instead of the stack
+    accumulator acc[MAX_PLY + 1]; // of the position at each ply, kept while a network is loaded
+};
+
+static uint32_t elapsed_ms(const timespec& start) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+static bool out_of_time(searcher& s) {
+    if (!s.stopped && !(s.nodes & 1023)) { // the limits and the other threads are only checked every so often
+        if (s.main) {
+            const search_limits& l = *s.limits;
+            bool done = (l.stop && __atomic_load_n(l.stop, __ATOMIC_RELAXED)) || (l.nodes && s.nodes >= l.nodes);
+            if (l.time_ms && !done) {
+                timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                done = now.tv_sec > s.deadline.tv_sec || (now.tv_sec == s.deadline.tv_sec && now.tv_nsec >= s.deadline.tv_nsec);
+            }
+            if (done) __atomic_store_n(s.stop, true, __ATOMIC_RELAXED);
+        }
+        s.stopped = __atomic_load_n(s.stop, __ATOMIC_RELAXED);
+    }
+    return s.stopped;
+}
+
+static bool is_noisy(move m) { // a capture or a promotion
+    return m.capture || is_promotion(m);
+}
+
+// most valuable victim first, least valuable attacker first among those
+static int32_t mvv_lva(const game& g, move m) {
+    kind attacker = get_kind(g.b, m.src_x, m.src_y);
+    score gain = piece_values[get_kind(g.b, m.dst_x, m.dst_y)];
+    if (is_promotion(m)) gain += piece_values[promoted_kind(m)] - piece_values[PAWN];
+    return gain * 16 - piece_values[attacker];
+}
+
+// how often quiet moves of the piece on m's square to its destination have caused cutoffs
+static uint32_t& history_score(searcher& s, move m) {
+    return s.history[get_piece(s.g.b, m.src_x, m.src_y)][m.dst_y * 8 + m.dst_x];
+}
+
+// captures and promotions first by mvv_lva(), keeping the order otherwise
+static void order_moves(const game& g, move_list& list) {
+    int32_t keys[MAX_MOVES];
+    for (uint16_t i = 0; i < list.length; i ++) keys[i] = is_noisy(list.moves[i]) ? mvv_lva(g, list.moves[i]) : -(1 << 20);
+    for (uint16_t i = 1; i < list.length; i ++) {
+        move m = list.moves[i];
+        int32_t key = keys[i];
+        uint16_t j = i;
+        for (; j > 0 && keys[j - 1] < key; j --) list.moves[j] = list.moves[j - 1], keys[j] = keys[j - 1];
+        list.moves[j] = m, keys[j] = key;
+    }
+}
+
+enum pick_stage : uint8_t {
+    PICK_HASH_MOVE,
+    GENERATE_CAPTURES,
+    PICK_CAPTURES,
+    PICK_KILLERS,
+    GENERATE_QUIETS,
+    PICK_QUIETS,
+    PICKED_ALL
+};
+
+// Hands out the moves of a position one at a time: the hash move, captures by mvv_lva(),
+// killers, then quiet moves by history. Each group is only generated once the ones before
+// it are used up, so a cutoff early on skips the rest of the work.
+struct move_picker {
+    ply_moves* at; // the searcher's, for the ply being searched
+    uint16_t next;
+    pick_stage stage;
+    uint8_t next_killer;
+    move hash_move;
+    const move* killers;
+    bool captures_only;
+};
+
+// with no killers, only the hash move and captures get picked
+static void start_picking(move_picker& mp, ply_moves& at, move hash_move, const move* killers) {
+    mp.at = &at;
+    mp.at->list.length = mp.next = 0;
+    mp.stage = PICK_HASH_MOVE;
+    mp.captures_only = !killers;
+    mp.next_killer = 0;
+    mp.hash_move = hash_move;
+    mp.killers = killers;
+}
+
+// takes the best scored move out of the ones left
+static move take_best(move_picker& mp) {
+    move* moves = mp.at->list.moves;
+    int32_t* scores = mp.at->scores;
+    uint16_t best = mp.next;
+    for (uint16_t i = mp.next + 1; i < mp.at->list.length; i ++) if (scores[i] > scores[best]) best = i;
+    move m = moves[best];
+    int32_t v = scores[best];
+    moves[best] = moves[mp.next], scores[best] = scores[mp.next];
+    moves[mp.next] = m, scores[mp.next] = v;
+    mp.next ++;
+    return m;
+}
+
+static bool next_move(searcher& s, move_picker& mp, color c, move& m) {
+    while (true) {
+        switch (mp.stage) {
+            case PICK_HASH_MOVE:
+                mp.stage = GENERATE_CAPTURES;
+                if (mp.hash_move != INVALID_MOVE && is_legal(s.g, c, mp.hash_move)) {
+                    m = mp.hash_move;
+                    return true;
+                }
+                break;
+            case GENERATE_CAPTURES:
+                add_moves(s.g, c, mp.at->list, CAPTURES);
+                for (uint16_t i = 0; i < mp.at->list.length; i ++) mp.at->scores[i] = mvv_lva(s.g, mp.at->list.moves[i]);
+                mp.stage = PICK_CAPTURES;
+                break;
+            case PICK_CAPTURES:
+                while (mp.next < mp.at->list.length) {
+                    m = take_best(mp);
+                    if (m != mp.hash_move) return true;
+                }
+                mp.stage = mp.captures_only ? PICKED_ALL : PICK_KILLERS;
+                break;
+            case PICK_KILLERS:
+                while (mp.next_killer < 2) { // from a sibling position, so they may not even be legal here
+                    m = mp.killers[mp.next_killer ++];
+                    if (m != INVALID_MOVE && m != mp.hash_move && !is_noisy(m) && is_legal(s.g, c, m)) return true;
+                }
+                mp.stage = GENERATE_QUIETS;
+                break;
+            case GENERATE_QUIETS:
+                mp.at->list.length = mp.next = 0;
+                add_moves(s.g, c, mp.at->list, QUIETS);
+                for (uint16_t i = 0; i < mp.at->list.length; i ++) mp.at->scores[i] = history_score(s, mp.at->list.moves[i]);
+                mp.stage = PICK_QUIETS;
+                break;
+            case PICK_QUIETS:
+                while (mp.next < mp.at->list.length) {
+                    m = take_best(mp);
+                    if (m != mp.hash_move && m != mp.killers[0] && m != mp.killers[1]) return true;
+                }
+                mp.stage = PICKED_ALL;
+                break;
+            case PICKED_ALL:
+                return false;
+        }
+    }
+}
+
+// a quiet move refuted the opponent's last move, so try it early in similar positions
+static void record_cutoff(searcher& s, move m, uint8_t depth, uint8_t ply) {
+    move* killers = s.killers[ply];
+    if (killers[0] != m) killers[1] = killers[0], killers[0] = m;
+    uint32_t& h = history_score(s, m);
+    h += depth * depth;
+    if (h > 1u << 30) { // keep the scores from overflowing, older cutoffs counting for less
+        for (uint8_t p = 0; p < 16; p ++) for (uint8_t sq = 0; sq < 64; sq ++) s.history[p][sq] /= 2;
+    }
+}
+
+// the table keeps mate scores as plies from the stored position rather than from the root
+static score to_table(score v, uint8_t ply) {
+    return v >= MATE_SCORE - MAX_PLY ? v + ply : v <= -MATE_SCORE + MAX_PLY ? v - ply : v;
+}
+
+static score from_table(score v, uint8_t ply) {
+    return v >= MATE_SCORE - MAX_PLY ? v - ply : v <= -MATE_SCORE + MAX_PLY ? v + ply : v;
+}
+
+// make_move(), and the accumulator for the position it leads to
+static void play(searcher& s, move m, undo& u, uint8_t ply) {
+    if (network_id) move_accumulator(s.g, m, s.acc[ply], s.acc[ply + 1]);
+    make_move(s.g, m, u);
+}
+
+// Plays out captures and promotions until the position is quiet, so the score isn't taken in
+// the middle of an exchange. The side to move can stand pat instead of capturing, and captures
+// that lose material by static_exchange() aren't searched. In check, every evasion is tried.
+static score quiesce(searcher& s, color c, score alpha, score beta, uint8_t ply) {
+    s.nodes ++;
+    if (out_of_time(s)) return 0;
+    bool in_check = c == WHITE ? s.g.white_in_check : s.g.black_in_check;
+    score best = -MATE_SCORE - 1;
+    if (!in_check || ply >= MAX_PLY) {
+        best = network_id ? network_score(s.acc[ply], c) : get_score(s.g, c);
+        if (best >= beta || ply >= MAX_PLY) return best;
+        if (best > alpha) alpha = best;
+    }
+
+    move_picker mp;
+    start_picking(mp, s.plies[ply], INVALID_MOVE, in_check ? s.killers[ply] : nullptr);
+    color other = c == WHITE ? BLACK : WHITE;
+    move m;
+    uint8_t tried = 0;
+    while (next_move(s, mp, c, m)) {
+        tried ++;
+        if (!in_check && static_exchange(s.g, m) < 0) continue;
+        undo u;
+        play(s, m, u, ply);
+        score v = -quiesce(s, other, -beta, -alpha, ply + 1);
+        unmake_move(s.g, u);
+        if (s.stopped) return 0;
+        if (v > best) {
+            best = v;
+            if (v > alpha) alpha = v;
+            if (alpha >= beta) break;
+        }
+    }
+    if (in_check && !tried) return -MATE_SCORE + ply;
+    return best;
+}
+
+// mates past MAX_PLY stay below the mate scores the table adjusts, but above any evaluation
+static score tablebase_score(const tb_result& r, uint8_t ply) {
+    score distance = ply + r.plies;
+    score value = distance < MAX_PLY ? MATE_SCORE - distance : MATE_SCORE / 2 - distance;
+    return r.wdl > 0 ? value : r.wdl < 0 ? -value : 0;
+}
+
+static score negamax(searcher& s, color c, uint8_t depth, score alpha, score beta, uint8_t ply) {
+    tb_result r;
+    if (ply && __builtin_popcountll(s.g.pieces) <= tablebase_pieces && probe_tablebase(s.g, c, r)) return tablebase_score(r, ply);
+    if (!depth || ply >= MAX_PLY) return quiesce(s, c, alpha, beta, ply);
+    s.nodes ++;
+    if (out_of_time(s)) return 0;
+
+    uint64_t key = game_key(s.g, c);
+    tt_hit hit;
+    move hash_move = INVALID_MOVE;
+    if (probe_table(*s.table, key, hit)) {
+        hash_move = hit.best;
+        score v = from_table(hit.value, ply);
+        if (hit.depth >= depth && (hit.b == EXACT_BOUND || (hit.b == LOWER_BOUND && v >= beta) || (hit.b == UPPER_BOUND && v <= alpha)))
+            return v;
+    }
+
+    move_picker mp;
+    start_picking(mp, s.plies[ply], hash_move, s.killers[ply]);
+    color other = c == WHITE ? BLACK : WHITE;
+    score best = -MATE_SCORE - 1, original_alpha = alpha;
+    move m, best_move = INVALID_MOVE;
+    uint8_t tried = 0;
+    while (next_move(s, mp, c, m)) {
+        bool quiet = !is_noisy(m);
+        undo u;
+        play(s, m, u, ply);
+        score v;
+        if (!tried ++) v = -negamax(s, other, depth - 1, -beta, -alpha, ply + 1);
+        else { // prove the move is no better than the first with a null window, search properly if it is
+            v = -negamax(s, other, depth - 1, -alpha - 1, -alpha, ply + 1);
+            if (v > alpha && v < beta) v = -negamax(s, other, depth - 1, -beta, -alpha, ply + 1);
+        }
+        unmake_move(s.g, u);
+        if (s.stopped) return 0;
+        if (v > best) {
+            best = v, best_move = m;
+            if (v > alpha) alpha = v;
+            if (alpha >= beta) {
+                if (quiet) record_cutoff(s, m, depth, ply);
+                break;
+            }
+        }
+    }
+    if (!tried) return (c == WHITE ? s.g.white_in_check : s.g.black_in_check) ? -MATE_SCORE + ply : 0;
+    store_table(*s.table, key, best_move, to_table(best, ply), depth,
+        best >= beta ? LOWER_BOUND : best > original_alpha ? EXACT_BOUND : UPPER_BOUND);
+    return best;
+}
+
+// iterative deepening from first_depth, stopping early on the main thread once the time is half gone
+static void deepen(searcher& s, color c, move_list& root, uint8_t first_depth, uint8_t max_depth, search_result& result) {
+    color other = c == WHITE ? BLACK : WHITE;
+    for (uint8_t depth = first_depth; depth <= max_depth; depth ++) {
+        score alpha = -MATE_SCORE - 1, beta = MATE_SCORE + 1;
+        uint16_t best = 0;
+        for (uint16_t i = 0; i < root.length; i ++) {
+            undo u;
+            play(s, root.moves[i], u, 0);
+            score v;
+            if (!i) v = -negamax(s, other, depth - 1, -beta, -alpha, 1);
+            else {
+                v = -negamax(s, other, depth - 1, -alpha - 1, -alpha, 1);
+                if (v > alpha && v < beta) v = -negamax(s, other, depth - 1, -beta, -alpha, 1);
+            }
+            unmake_move(s.g, u);
+            if (s.stopped) break;
+            if (v > alpha) alpha = v, best = i;
+        }
+        // the previous best move is searched first, so anything that beat it before time ran out is still better
+        if (s.stopped && alpha < -MATE_SCORE) break;
+
+        move m = root.moves[best]; // searched first next time round
+        for (uint16_t i = best; i > 0; i --) root.moves[i] = root.moves[i - 1];
+        root.moves[0] = m;
+        result.best = m, result.value = alpha;
+        if (s.stopped) break;
+        result.depth = depth;
+        store_table(*s.table, game_key(s.g, c), m, to_table(alpha, 0), depth, EXACT_BOUND);
+        if (!s.main) continue;
+
+        result.nodes = s.nodes, result.elapsed_ms = elapsed_ms(s.start);
+        if (s.limits->report) s.limits->report(s.g, c, result);
+        if (alpha >= MATE_SCORE - MAX_PLY) break; // no shorter mate to find
+        // another iteration takes several times as long as this one, so don't start one that can't finish
+        if (s.limits->time_ms && result.elapsed_ms * 2 > s.limits->time_ms) break;
+    }
+}
+
+// Lazy SMP: helpers search the same root without coordinating, and speed up the main
+// thread by filling the shared table. Half of them run a ply ahead and some start on
+// a different first move, so they don't all walk the same tree in lockstep.
+struct helper {
+    searcher s;
+    color c;
+    move_list root;
+    uint8_t first_depth;
+    search_result result;
+    pthread_t thread;
+    bool running;
+};
+
+static void* run_helper(void* arg) {
+    helper& h = *(helper*)arg;
+    deepen(h.s, h.c, h.root, h.first_depth, MAX_PLY, h.result);
+    return nullptr;
+}
+
+search_result search(const game& g, color c, const move_list& moves, const search_limits& limits) {
+    bool stop = false;
+    searcher s;
+    s.g = g;
+    if (network_id) refresh_accumulator(s.g, s.acc[0]); // the moves searched update it from there
+    s.nodes = 0;
+    s.limits = &limits;
+    s.table = limits.table ? limits.table : &search_table;
+    s.stop = &stop, s.stopped = false, s.main = true;
+    for (uint8_t i = 0; i < MAX_PLY; i ++) s.killers[i][0] = s.killers[i][1] = INVALID_MOVE;
+    memset(s.history, 0, sizeof(s.history));
+    clock_gettime(CLOCK_MONOTONIC, &s.start);
+    s.deadline.tv_sec = s.start.tv_sec + limits.time_ms / 1000;
+    s.deadline.tv_nsec = s.start.tv_nsec + limits.time_ms % 1000 * 1000000l;
+    if (s.deadline.tv_nsec >= 1000000000l) s.deadline.tv_sec ++, s.deadline.tv_nsec -= 1000000000l;
+
+    search_result result = { moves.length ? moves.moves[0] : INVALID_MOVE, 0, 0, 0, 0 };
+    if (moves.length < 2) return result; // nothing to decide
+    // search_table follows the settings, other tables are sized by whoever owns them
+    if (!limits.table && (search_table.mb != search_hash_mb || search_table.huge_pages != search_huge_pages))
+        resize_table(search_table, search_hash_mb, search_huge_pages);
+    __atomic_fetch_add(&s.table->generation, 1, __ATOMIC_RELAXED); // searches may run side by side
+
+    move_list root = moves;
+    order_moves(s.g, root);
+    uint8_t max_depth = limits.depth && limits.depth < MAX_PLY ? limits.depth : MAX_PLY;
+    uint8_t threads = limits.threads ? limits.threads : 1;
+
+    helper* helpers = threads > 1 ? (helper*)malloc((threads - 1) * sizeof(helper)) : nullptr;
+    for (uint8_t i = 1; i < threads; i ++) {
+        helper& h = helpers[i - 1];
+        h.s = s;
+        h.s.main = false;
+        h.c = c, h.first_depth = 1 + i % 2;
+        h.root = root;
+        if (i % 4 >= 2) h.root.moves[0] = root.moves[1], h.root.moves[1] = root.moves[0];
+        h.result = result;
+        h.running = !pthread_create(&h.thread, nullptr, run_helper, &h);
+    }
+    deepen(s, c, root, 1, max_depth, result);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+    result.nodes = s.nodes;
+    for (uint8_t i = 1; i < threads; i ++) {
+        helper& h = helpers[i - 1];
+        if (!h.running) continue;
+        pthread_join(h.thread, nullptr);
+        result.nodes += h.s.nodes;
+    }
+    free(helpers);
+    result.elapsed_ms = elapsed_ms(s.start);
+    return result;
+}
+
+// the table's best move for the position after m, if it is legal there
+static move expected_reply(const transposition_table& t, const game& g, color c, move m) {
+    if (m == INVALID_MOVE) return INVALID_MOVE;
+    game copy = g;
+    move_piece(copy, m);
+    color other = c == WHITE ? BLACK : WHITE;
+    tt_hit hit;
+    if (!probe_table(t, game_key(copy, other), hit) || hit.best == INVALID_MOVE || !is_legal(copy, other, hit.best)) return INVALID_MOVE;
+    return hit.best;
+}
+
+move alpha_beta(const game& g, color c, const move_list& moves, const decider_context& context) {
+    uint64_t now = monotonic_ms();
+    uint32_t time_ms = !context.deadline_ms ? 0 : context.deadline_ms > now ? context.deadline_ms - now : 1;
+    search_limits limits = { time_ms, context.nodes, 0, search_threads, context.stop, nullptr, context.table };
+    move best = search(g, c, moves, limits).best;
+    if (context.reply) *context.reply = expected_reply(context.table ? *context.table : search_table, g, c, best);
+    return best;
+}
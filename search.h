@@ -0,0 +1,73 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "chess.h"
+
+#define MAX_PLY 64
+#define MATE_SCORE 1000000 // less the number of plies to the mate
+
+struct search_result {
+    move best;
+    score value; // from the point of view of the side to move
+    uint8_t depth; // last depth fully searched
+    uint64_t nodes;
+    uint32_t elapsed_ms;
+};
+
+struct transposition_table;
+
+struct search_limits {
+    uint32_t time_ms; // 0 for no time limit
+    uint64_t nodes; // as counted by the main thread, 0 for no limit
+    uint8_t depth; // 0 for no limit
+    uint8_t threads;
+    const bool* stop; // set from another thread to end the search early, or null
+    void (*report)(const game& g, color c, const search_result& progress); // after each depth, or null
+    transposition_table* table; // probed and filled, search_table if null
+};
+
+enum bound : uint8_t {
+    UPPER_BOUND = 1, // every move failed low, the score is at most this
+    LOWER_BOUND = 2, // a move failed high, the score is at least this
+    EXACT_BOUND = 3
+};
+
+// check is key ^ data, so an entry torn by two threads writing at once won't match either key
+struct tt_entry {
+    uint64_t check, data;
+};
+
+struct tt_bucket {
+    tt_entry entries[4]; // one cache line
+};
+
+struct transposition_table {
+    tt_bucket* buckets;
+    uint64_t mask, bytes;
+    uint8_t generation; // bumped every search, so entries from older ones get replaced first
+    uint32_t mb; // as asked for in resize_table()
+    bool huge_pages;
+};
+
+struct tt_hit {
+    move best;
+    score value; // mate scores are relative to the probed position
+    uint8_t depth;
+    bound b;
+};
+
+extern transposition_table search_table;
+
+// (re)allocates the table at the largest power of two buckets fitting in mb, emptying it
+bool resize_table(transposition_table& t, uint32_t mb, bool huge_pages);
+void clear_table(transposition_table& t);
+void free_table(transposition_table& t);
+bool probe_table(const transposition_table& t, uint64_t key, tt_hit& hit);
+void store_table(transposition_table& t, uint64_t key, move best, score value, uint8_t depth, bound b);
+
+// iterative deepening over the given root moves until one of the limits is reached,
+// with threads - 1 helpers sharing search_table
+search_result search(const game& g, color c, const move_list& moves, const search_limits& limits);
+move alpha_beta(const game& g, color c, const move_list& moves, const decider_context& context);
+
+#endif
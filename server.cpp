@@ -0,0 +1,358 @@
+#include "server.h"
+#include "search.h"
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_CONNECTIONS 64
+#define MAX_LINE 256 // longest command taken, a FEN with room to spare
+#define MAX_OUTPUT (1 << 20) // waiting for a client that doesn't read, after which lines are dropped
+#define NO_SESSION UINT32_MAX
+
+enum session_state : uint8_t {
+    FREE_SESSION,
+    CLIENT_TURN,
+    AI_TURN, // queued or being searched
+    CLOSING // ended while queued or searched, freed by the worker that takes it
+};
+
+// a game against one AI, in the pool run_server() allocates up front
+struct session {
+    game g; // left alone by the event loop while the AI is searching it
+    color c; // to move
+    color client;
+    const chess_ai* ai;
+    session_state state;
+    uint8_t connection;
+    uint32_t next; // in the free list or the AI's queue
+};
+
+struct connection {
+    int fd; // -1 if unused
+    char in[MAX_LINE];
+    uint32_t in_length;
+    char* out; // not sent yet
+    uint32_t out_length, out_capacity;
+};
+
+struct server_state {
+    const server_settings* settings;
+    session* sessions;
+    connection connections[MAX_CONNECTIONS];
+    pthread_mutex_t lock; // for everything here
+    pthread_cond_t queued;
+    uint32_t free_first; // linked through session::next, NO_SESSION if empty
+    uint32_t queue_first, queue_last; // games waiting for the AI, oldest first
+    int wake[2]; // a pipe the workers write to when they leave output for the event loop
+};
+
+static void send_line(server_state& st, uint8_t ci, const char* format, ...) {
+    connection& cn = st.connections[ci];
+    char line[MAX_LINE];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    if (cn.fd < 0 || length < 0) return;
+    if (length > int(sizeof(line)) - 2) length = sizeof(line) - 2;
+    line[length ++] = '\n';
+
+    if (cn.out_length + length > cn.out_capacity) {
+        uint32_t capacity = cn.out_capacity ? cn.out_capacity * 2 : 4096;
+        if (capacity > MAX_OUTPUT) return;
+        char* out = (char*)realloc(cn.out, capacity);
+        if (!out) return;
+        cn.out = out, cn.out_capacity = capacity;
+    }
+    memcpy(cn.out + cn.out_length, line, length);
+    cn.out_length += length;
+}
+
+static void free_session(server_state& st, uint32_t id) {
+    st.sessions[id].state = FREE_SESSION;
+    st.sessions[id].next = st.free_first;
+    st.free_first = id;
+}
+
+static void queue_ai(server_state& st, uint32_t id) {
+    st.sessions[id].state = AI_TURN;
+    st.sessions[id].next = NO_SESSION;
+    if (st.queue_last == NO_SESSION) st.queue_first = id;
+    else st.sessions[st.queue_last].next = id;
+    st.queue_last = id;
+    pthread_cond_signal(&st.queued);
+}
+
+// reports and frees the game if it's over
+static bool end_if_over(server_state& st, uint32_t id) {
+    session& s = st.sessions[id];
+    move_list list;
+    add_moves(s.g, s.c, list);
+    bool in_check = s.c == WHITE ? s.g.white_in_check : s.g.black_in_check;
+    const char* reason = !list.length ? (in_check ? "checkmate" : "stalemate") : s.g.halfmove_clock >= 100 ? "fifty-move rule" : nullptr;
+    if (!reason) return false;
+    send_line(st, s.connection, "%u end %s %s", id, !list.length && in_check ? (s.c == WHITE ? "0-1" : "1-0") : "1/2-1/2", reason);
+    free_session(st, id);
+    return true;
+}
+
+// takes the games waiting for the AI one move at a time, so none waits behind another's whole game
+static void* run_worker(void* arg) {
+    server_state& st = *(server_state*)arg;
+    seed_random(time(0) ^ uint64_t(pthread_self()));
+    transposition_table table = {}; // the worker's own, so games on other workers don't evict its entries
+    resize_table(table, search_hash_mb, search_huge_pages);
+    pthread_mutex_lock(&st.lock);
+    while (true) {
+        while (st.queue_first == NO_SESSION) pthread_cond_wait(&st.queued, &st.lock);
+        uint32_t id = st.queue_first;
+        session& s = st.sessions[id];
+        st.queue_first = s.next;
+        if (st.queue_first == NO_SESSION) st.queue_last = NO_SESSION;
+        if (s.state == CLOSING) {
+            free_session(st, id);
+            continue;
+        }
+        pthread_mutex_unlock(&st.lock);
+
+        move_list list;
+        add_moves(s.g, s.c, list); // not empty, or end_if_over() would have ended the game
+        decider_context context = context_for(search_time_ms);
+        context.table = &table;
+        move m = decide(*s.ai, s.g, s.c, list, context);
+
+        pthread_mutex_lock(&st.lock);
+        if (s.state == CLOSING) {
+            free_session(st, id);
+            continue;
+        }
+        char name[16];
+        move_to_string(m, name);
+        move_piece(s.g, m);
+        s.c = s.c == WHITE ? BLACK : WHITE;
+        s.state = CLIENT_TURN;
+        send_line(st, s.connection, "%u move %s", id, name);
+        end_if_over(st, id);
+        char byte = 0;
+        if (write(st.wake[1], &byte, 1) < 0) continue; // already full of wake-ups
+    }
+}
+
+static void start_game(server_state& st, uint8_t ci) {
+    const char* ai_name = strtok(nullptr, " \r\t");
+    const char* color_name = strtok(nullptr, " \r\t");
+    const char* fen = strtok(nullptr, "\r\n"); // the rest of the line
+    const chess_ai* ai = ai_name ? find_ai(ai_name) : nullptr;
+    color client = color_name ? color_from_string(color_name) : INVALID_COLOR;
+    if (!ai || client == INVALID_COLOR) {
+        send_line(st, ci, "error usage: new <ai> <white|black> [<fen>]");
+        return;
+    }
+    if (st.free_first == NO_SESSION) {
+        send_line(st, ci, "error all %u games taken", st.settings->sessions);
+        return;
+    }
+
+    uint32_t id = st.free_first;
+    session& s = st.sessions[id];
+    s.c = WHITE;
+    if (fen) s.c = game_from_fen(s.g, fen);
+    else setup_game(s.g);
+    if (s.c == INVALID_COLOR) {
+        send_line(st, ci, "error bad FEN '%s'", fen);
+        return;
+    }
+    st.free_first = s.next;
+    s.client = client, s.ai = ai, s.connection = ci;
+    s.state = CLIENT_TURN;
+    send_line(st, ci, "%u new", id);
+    if (!end_if_over(st, id) && s.c != client) queue_ai(st, id);
+}
+
+static void handle_line(server_state& st, uint8_t ci, char* line) {
+    const char* word = strtok(line, " \r\t");
+    if (!word) return;
+    if (!strcmp(word, "new")) {
+        start_game(st, ci);
+        return;
+    }
+
+    char* end;
+    unsigned long id = strtoul(word, &end, 10);
+    session* s = *end || id >= st.settings->sessions ? nullptr : st.sessions + id;
+    if (!s || s->state == FREE_SESSION || s->state == CLOSING || s->connection != ci) {
+        send_line(st, ci, "error no game '%s'", word);
+        return;
+    }
+    const char* cmd = strtok(nullptr, " \r\t");
+    if (cmd && !strcmp(cmd, "move")) {
+        const char* text = strtok(nullptr, " \r\t");
+        if (s->state != CLIENT_TURN) {
+            send_line(st, ci, "error %lu not your turn", id);
+            return;
+        }
+        move m = text ? move_from_san(s->g, s->c, text) : INVALID_MOVE;
+        if (m == INVALID_MOVE) {
+            send_line(st, ci, "error %lu illegal move '%s'", id, text ? text : "");
+            return;
+        }
+        move_piece(s->g, m);
+        s->c = s->c == WHITE ? BLACK : WHITE;
+        if (!end_if_over(st, id)) queue_ai(st, id);
+    }
+    else if (cmd && !strcmp(cmd, "fen")) {
+        char fen[MAX_FEN];
+        game_to_fen(s->g, s->c, fen);
+        send_line(st, ci, "%lu fen %s", id, fen);
+    }
+    else if (cmd && !strcmp(cmd, "quit")) {
+        if (s->state == AI_TURN) s->state = CLOSING;
+        else free_session(st, id);
+        send_line(st, ci, "%lu quit", id);
+    }
+    else send_line(st, ci, "error usage: <id> move <move>|fen|quit");
+}
+
+// ends the client's games along with it
+static void close_connection(server_state& st, uint8_t ci) {
+    connection& cn = st.connections[ci];
+    for (uint32_t id = 0; id < st.settings->sessions; id ++) {
+        session& s = st.sessions[id];
+        if (s.connection != ci || s.state == FREE_SESSION || s.state == CLOSING) continue;
+        if (s.state == AI_TURN) s.state = CLOSING;
+        else free_session(st, id);
+    }
+    close(cn.fd);
+    free(cn.out);
+    cn.fd = -1, cn.out = nullptr;
+    cn.in_length = cn.out_length = cn.out_capacity = 0;
+}
+
+// takes in what the client sent, running each complete line; false once it has hung up
+static bool read_connection(server_state& st, uint8_t ci) {
+    connection& cn = st.connections[ci];
+    ssize_t length = read(cn.fd, cn.in + cn.in_length, sizeof(cn.in) - 1 - cn.in_length);
+    if (length < 0) return errno == EAGAIN || errno == EINTR;
+    if (!length) return false;
+    cn.in_length += length;
+
+    uint32_t start = 0;
+    for (uint32_t i = 0; i < cn.in_length; i ++) {
+        if (cn.in[i] != '\n') continue;
+        cn.in[i] = 0;
+        handle_line(st, ci, cn.in + start);
+        start = i + 1;
+    }
+    if (!start && cn.in_length == sizeof(cn.in) - 1) { // no line ends in the whole buffer
+        send_line(st, ci, "error line longer than %u characters", MAX_LINE - 2);
+        cn.in_length = 0;
+    }
+    else {
+        memmove(cn.in, cn.in + start, cn.in_length - start);
+        cn.in_length -= start;
+    }
+    return true;
+}
+
+static bool write_connection(connection& cn) {
+    ssize_t length = send(cn.fd, cn.out, cn.out_length, MSG_NOSIGNAL);
+    if (length < 0) return errno == EAGAIN || errno == EINTR;
+    memmove(cn.out, cn.out + length, cn.out_length - length);
+    cn.out_length -= length;
+    return true;
+}
+
+static int listen_on(const char* path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) return -1;
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    unlink(path);
+    if (bind(fd, (sockaddr*)&address, sizeof(address)) || listen(fd, MAX_CONNECTIONS) || fcntl(fd, F_SETFL, O_NONBLOCK)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool run_server(const server_settings& settings) {
+    if (!settings.path || !settings.threads || !settings.sessions || settings.sessions == NO_SESSION) return false;
+    server_state st = {};
+    st.settings = &settings;
+    st.sessions = (session*)calloc(settings.sessions, sizeof(session));
+    if (!st.sessions) return false;
+    for (uint32_t id = 0; id < settings.sessions; id ++) st.sessions[id].next = id + 1 < settings.sessions ? id + 1 : NO_SESSION;
+    st.queue_first = st.queue_last = NO_SESSION;
+    for (uint8_t ci = 0; ci < MAX_CONNECTIONS; ci ++) st.connections[ci].fd = -1;
+    pthread_mutex_init(&st.lock, nullptr);
+    pthread_cond_init(&st.queued, nullptr);
+
+    int listener = listen_on(settings.path);
+    if (listener < 0 || pipe(st.wake) || fcntl(st.wake[0], F_SETFL, O_NONBLOCK) || fcntl(st.wake[1], F_SETFL, O_NONBLOCK)) {
+        perror(settings.path);
+        free(st.sessions);
+        return false;
+    }
+    uint8_t started = 0;
+    for (pthread_t thread; started < settings.threads && !pthread_create(&thread, nullptr, run_worker, &st); started ++) {
+        pthread_detach(thread);
+    }
+    if (!started) {
+        close(listener);
+        free(st.sessions);
+        return false;
+    }
+    printf("Serving %u games of %u bytes each on %s, %u threads searching.\n", settings.sessions, unsigned(sizeof(session)),
+        settings.path, started);
+    fflush(stdout);
+
+    pollfd fds[MAX_CONNECTIONS + 2];
+    uint8_t polled[MAX_CONNECTIONS]; // connection for each of fds from 2 on
+    while (true) {
+        fds[0] = { listener, POLLIN, 0 }, fds[1] = { st.wake[0], POLLIN, 0 };
+        nfds_t length = 2;
+        pthread_mutex_lock(&st.lock);
+        for (uint8_t ci = 0; ci < MAX_CONNECTIONS; ci ++) {
+            connection& cn = st.connections[ci];
+            if (cn.fd < 0) continue;
+            fds[length] = { cn.fd, short(POLLIN | (cn.out_length ? POLLOUT : 0)), 0 };
+            polled[length ++ - 2] = ci;
+        }
+        pthread_mutex_unlock(&st.lock);
+        if (poll(fds, length, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return false;
+        }
+
+        char drained[64];
+        if (fds[1].revents) while (read(st.wake[0], drained, sizeof(drained)) > 0) {}
+        pthread_mutex_lock(&st.lock);
+        for (nfds_t i = 2; i < length; i ++) {
+            uint8_t ci = polled[i - 2];
+            bool open = true;
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) open = read_connection(st, ci);
+            if (open && st.connections[ci].out_length) open = write_connection(st.connections[ci]);
+            if (!open) close_connection(st, ci);
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            uint8_t ci = 0;
+            while (ci < MAX_CONNECTIONS && st.connections[ci].fd >= 0) ci ++;
+            if (fd >= 0 && (ci == MAX_CONNECTIONS || fcntl(fd, F_SETFL, O_NONBLOCK))) close(fd);
+            else if (fd >= 0) st.connections[ci].fd = fd;
+        }
+        pthread_mutex_unlock(&st.lock);
+    }
+}
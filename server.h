@@ -0,0 +1,26 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "chess.h"
+
+struct server_settings {
+    const char* path; // of the Unix domain socket, replaced if it exists
+    uint8_t threads; // moves searched at once, across all games
+    uint32_t sessions; // games hosted at once, their memory taken up front
+};
+
+// Hosts games against the registered AIs for any number of clients on a Unix domain socket,
+// a command per line:
+//   new <ai> <white|black> [<fen>]  starts a game, the client playing the color given;
+//                                   answered '<id> new', then the AI's move if it's to move
+//   <id> move <move>                the client's move, in coordinate or algebraic notation;
+//                                   answered '<id> move <move>' once the AI has replied
+//   <id> fen                        answered '<id> fen <fen>'
+//   <id> quit                       ends the game, answered '<id> quit'
+// Finished games are reported '<id> end 1-0|0-1|1/2-1/2 <reason>' and ended, and anything
+// that can't be done is answered 'error <what went wrong>'. The AIs' moves are searched by a
+// pool of threads, each with its own transposition table, in the order they came due. Runs
+// until killed; returns false if it couldn't start.
+bool run_server(const server_settings& settings);
+
+#endif
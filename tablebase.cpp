@@ -0,0 +1,383 @@
+#include "tablebase.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TB_BLOCK_SIZE 4096 // positions per compressed block, the most a probe has to decode
+#define TB_VERSION 2
+#define MAX_TABLEBASES 256
+#define KING_PAIRS 1806 // with pawns, 462 without
+
+// A file is this header, then 2 * blocks + 1 offsets to where each block's bytes start, then
+// the blocks: the outcomes' first, 0 for a draw, 1 for a win and 2 for a loss in two bits
+// each, four to a byte from the low bits up, then the moves to mate's, a byte each. Those
+// bytes are a control byte c followed by either c + 1 bytes as they are when c < 128, or by
+// one byte repeated c - 126 times. Values that are never read, illegal positions' and the
+// moves to mate of draws, take the value before them to lengthen the runs.
+struct tb_header {
+    char magic[4]; // "MKTB"
+    uint8_t version, length;
+    uint8_t pieces[6];
+    uint32_t block_size, blocks; // per stream
+};
+
+struct tablebase {
+    uint32_t material; // see material_code()
+    uint8_t length;
+    piece pieces[MAX_TB_PIECES];
+    const uint8_t* data; // the mapped file
+    uint64_t bytes;
+    uint32_t blocks; // per stream
+    const uint64_t* offsets;
+    const uint8_t* compressed; // where the blocks start
+};
+
+static tablebase tablebases[MAX_TABLEBASES];
+static uint32_t tablebases_length = 0;
+uint8_t tablebase_pieces = 0;
+
+static const char tablebase_letters[] = "  PNBRQK";
+
+// counts of each kind but kings, 3 bits apiece, white's in the low half and black's above
+static uint32_t material_code(const piece* pieces, uint8_t length) {
+    uint32_t code = 0;
+    for (uint8_t i = 0; i < length; i ++) {
+        if (get_kind(pieces[i]) != KING) code += 1u << ((get_kind(pieces[i]) - PAWN) * 3 + (get_color(pieces[i]) == BLACK ? 15 : 0));
+    }
+    return code;
+}
+
+static uint32_t swap_colors(uint32_t code) {
+    return code >> 15 | (code & 0x7fff) << 15;
+}
+
+// bare kings, or a lone knight or bishop against a king
+static bool cannot_mate(uint32_t code) {
+    const uint32_t minor = 1u << (KNIGHT - PAWN) * 3 | 1u << (BISHOP - PAWN) * 3;
+    return __builtin_popcount(code) <= 1 && !(code & ~(minor | minor << 15));
+}
+
+static uint8_t table_rank(piece p) {
+    return (get_color(p) == BLACK ? 8 : 0) + (get_kind(p) == KING ? 0 : KING + 1 - get_kind(p));
+}
+
+bool parse_tablebase_name(const char* name, piece* pieces, uint8_t& length) {
+    length = 0;
+    color c = WHITE;
+    uint8_t kings[2] = { 0, 0 };
+    for (const char* reader = name; *reader; reader ++) {
+        if (*reader == 'v' && c == WHITE) {
+            c = BLACK;
+            continue;
+        }
+        const char* letter = strchr(tablebase_letters + 2, *reader);
+        if (!letter || length == MAX_TB_PIECES) return false;
+        kind k = kind(letter - tablebase_letters);
+        kings[c == BLACK] += k == KING;
+        pieces[length ++] = make_piece(c, k);
+    }
+    if (c != BLACK || kings[0] != 1 || kings[1] != 1) return false;
+    for (uint8_t i = 1; i < length; i ++) { // into table order
+        for (uint8_t j = i; j && table_rank(pieces[j]) < table_rank(pieces[j - 1]); j --) {
+            piece p = pieces[j];
+            pieces[j] = pieces[j - 1], pieces[j - 1] = p;
+        }
+    }
+    return true;
+}
+
+void tablebase_name(const piece* pieces, uint8_t length, char* buffer) {
+    for (uint8_t i = 0; i < length; i ++) {
+        if (i && get_color(pieces[i]) != get_color(pieces[i - 1])) *buffer ++ = 'v';
+        *buffer ++ = tablebase_letters[get_kind(pieces[i])];
+    }
+    *buffer = '\0';
+}
+
+// [pawns][white king][black king], -1 unless white's king is on a1-d1-d4 without pawns, and
+// black's on or below the long diagonal if white's is on it, or on files a to d with pawns
+static int16_t king_pair_index[2][64][64];
+static uint8_t king_pair_squares[2][KING_PAIRS][2];
+static uint16_t king_pairs[2];
+
+static struct king_pair_init {
+    king_pair_init() {
+        for (uint8_t pawns = 0; pawns < 2; pawns ++) for (uint8_t wk = 0; wk < 64; wk ++) for (uint8_t bk = 0; bk < 64; bk ++) {
+            int8_t dx = wk % 8 - bk % 8, dy = wk / 8 - bk / 8;
+            bool placed = wk % 8 < 4 && (dx < -1 || dx > 1 || dy < -1 || dy > 1);
+            if (!pawns) placed = placed && wk / 8 <= wk % 8 && (wk / 8 != wk % 8 || bk / 8 <= bk % 8);
+            king_pair_index[pawns][wk][bk] = placed ? king_pairs[pawns] : -1;
+            if (placed) king_pair_squares[pawns][king_pairs[pawns]][0] = wk, king_pair_squares[pawns][king_pairs[pawns] ++][1] = bk;
+        }
+    }
+} king_pair_init_instance;
+
+static bool has_pawns(const piece* pieces, uint8_t length) {
+    for (uint8_t i = 0; i < length; i ++) if (get_kind(pieces[i]) == PAWN) return true;
+    return false;
+}
+
+static uint8_t black_king(const piece* pieces, uint8_t length) {
+    uint8_t i = 1;
+    while (i < length - 1 && pieces[i] != make_piece(BLACK, KING)) i ++;
+    return i;
+}
+
+static uint8_t transpose(uint8_t sq) {
+    return (sq & 7) << 3 | sq >> 3;
+}
+
+uint64_t tablebase_size(const piece* pieces, uint8_t length) {
+    uint64_t size = 2 * king_pairs[has_pawns(pieces, length)];
+    for (uint8_t i = 2; i < length; i ++) size *= 64 - i;
+    return size;
+}
+
+uint64_t tablebase_index(const piece* pieces, const uint8_t* squares, uint8_t length, color c) {
+    bool pawns = has_pawns(pieces, length);
+    uint8_t bk = black_king(pieces, length);
+    uint8_t turned[MAX_TB_PIECES];
+    uint8_t flip = (squares[0] & 4 ? 7 : 0) | (!pawns && squares[0] & 32 ? 56 : 0); // white's king to files a-d, ranks 1-4
+    for (uint8_t i = 0; i < length; i ++) turned[i] = squares[i] ^ flip;
+    if (!pawns) { // under the long diagonal, and if on it, so is the first piece off it from black's king on
+        bool across = turned[0] / 8 > turned[0] % 8;
+        for (uint8_t n = 1, i = bk; n < length && turned[0] / 8 == turned[0] % 8; n ++, i = i + 1 < length ? i + 1 : 1) {
+            if (turned[i] / 8 == turned[i] % 8) continue;
+            across = turned[i] / 8 > turned[i] % 8;
+            break;
+        }
+        for (uint8_t i = 0; i < length && across; i ++) turned[i] = transpose(turned[i]);
+    }
+    int16_t kings = king_pair_index[pawns][turned[0]][turned[bk]];
+    if (kings < 0) return TB_NO_INDEX;
+    uint64_t index = (c == BLACK) * king_pairs[pawns] + kings;
+    pieces_set taken = 1ull << turned[0] | 1ull << turned[bk];
+    for (uint8_t i = 1; i < length; i ++) {
+        if (i == bk) continue;
+        index = index * (64 - __builtin_popcountll(taken)) + turned[i] - __builtin_popcountll(taken & ((1ull << turned[i]) - 1));
+        taken |= 1ull << turned[i];
+    }
+    return index;
+}
+
+color tablebase_squares(const piece* pieces, uint8_t length, uint64_t index, uint8_t* squares) {
+    bool pawns = has_pawns(pieces, length);
+    uint8_t bk = black_king(pieces, length);
+    uint64_t empty[MAX_TB_PIECES]; // the squares each piece was indexed among
+    for (uint8_t i = length, n = length - 1; i -- > 1;) {
+        if (i == bk) continue;
+        empty[i] = index % (64 - n), index /= 64 - n --;
+    }
+    uint16_t kings = index % king_pairs[pawns];
+    squares[0] = king_pair_squares[pawns][kings][0], squares[bk] = king_pair_squares[pawns][kings][1];
+    pieces_set taken = 1ull << squares[0] | 1ull << squares[bk];
+    for (uint8_t i = 1; i < length; i ++) {
+        if (i == bk) continue;
+        uint8_t sq = empty[i];
+        for (pieces_set rest = taken; rest && __builtin_ctzll(rest) <= sq; rest &= rest - 1) sq ++;
+        squares[i] = sq;
+        taken |= 1ull << sq;
+    }
+    return index / king_pairs[pawns] ? BLACK : WHITE;
+}
+
+// the table with this material, or with the colors swapped
+static const tablebase* find_tablebase(uint32_t code, bool& swapped) {
+    for (uint32_t i = 0; i < tablebases_length; i ++) {
+        if (tablebases[i].material == code) return swapped = false, &tablebases[i];
+        if (tablebases[i].material == swap_colors(code)) return swapped = true, &tablebases[i];
+    }
+    return nullptr;
+}
+
+bool has_tablebase(const piece* pieces, uint8_t length) {
+    bool swapped;
+    uint32_t code = material_code(pieces, length);
+    return cannot_mate(code) || find_tablebase(code, swapped);
+}
+
+// appends a block of values, in the control byte format above
+static void compress(const uint8_t* values, uint32_t length, uint8_t*& bytes, uint64_t& used, uint64_t& capacity) {
+    for (uint32_t i = 0; i < length;) {
+        if (used + 130 > capacity) bytes = (uint8_t*)realloc(bytes, capacity *= 2);
+        uint32_t run = 1;
+        while (i + run < length && run < 129 && values[i + run] == values[i]) run ++;
+        if (run >= 2) {
+            bytes[used ++] = run + 126, bytes[used ++] = values[i];
+            i += run;
+            continue;
+        }
+        uint32_t literal = 1; // up to where the next run starts
+        while (i + literal < length && literal < 128 && (i + literal + 1 >= length || values[i + literal] != values[i + literal + 1])) literal ++;
+        bytes[used ++] = literal - 1;
+        memcpy(bytes + used, values + i, literal);
+        used += literal, i += literal;
+    }
+}
+
+// the value at index left of the block starting at reader
+static uint8_t decompress(const uint8_t* reader, uint32_t left) {
+    while (true) {
+        uint32_t count = reader[0] < 128 ? reader[0] + 1 : reader[0] - 126;
+        if (left < count) return reader[0] < 128 ? reader[1 + left] : reader[1];
+        left -= count;
+        reader += reader[0] < 128 ? count + 1 : 2;
+    }
+}
+
+bool write_tablebase(const char* path, const piece* pieces, uint8_t length, const uint8_t* values) {
+    uint64_t size = tablebase_size(pieces, length);
+    tb_header header = {};
+    memcpy(header.magic, "MKTB", 4);
+    header.version = TB_VERSION, header.length = length;
+    for (uint8_t i = 0; i < length; i ++) header.pieces[i] = pieces[i];
+    header.block_size = TB_BLOCK_SIZE;
+    header.blocks = (size + TB_BLOCK_SIZE - 1) / TB_BLOCK_SIZE;
+
+    uint64_t* offsets = (uint64_t*)malloc((2 * header.blocks + 1) * sizeof(uint64_t));
+    uint64_t capacity = 1 << 20, used = 0;
+    uint8_t* bytes = (uint8_t*)malloc(capacity);
+    for (uint32_t block = 0; block < 2 * header.blocks; block ++) {
+        offsets[block] = used;
+        bool outcomes = block < header.blocks;
+        uint64_t start = uint64_t(outcomes ? block : block - header.blocks) * TB_BLOCK_SIZE;
+        uint64_t end = start + TB_BLOCK_SIZE < size ? start + TB_BLOCK_SIZE : size;
+        uint8_t filled[TB_BLOCK_SIZE];
+        for (uint64_t i = start; i < end; i ++) {
+            uint8_t value = values[i];
+            bool read = value != TB_ILLEGAL && (outcomes || value != TB_DRAW);
+            if (!read) filled[i - start] = i > start ? filled[i - start - 1] : 0;
+            else if (outcomes) filled[i - start] = value == TB_DRAW ? 0 : value % 2 ? 2 : 1;
+            else filled[i - start] = value / 2; // plies + 1 halved, the same moves for both sides
+        }
+        uint32_t length = end - start;
+        if (outcomes) {
+            for (uint32_t i = 0; i < length; i ++) filled[i / 4] = (i % 4 ? filled[i / 4] : 0) | filled[i] << 2 * (i % 4);
+            length = (length + 3) / 4;
+        }
+        compress(filled, length, bytes, used, capacity);
+    }
+    offsets[2 * header.blocks] = used;
+
+    FILE* file = fopen(path, "wb");
+    bool ok = file && fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(offsets, sizeof(uint64_t), 2 * header.blocks + 1, file) == 2 * header.blocks + 1
+        && fwrite(bytes, 1, used, file) == used;
+    if (file && fclose(file)) ok = false;
+    free(offsets);
+    free(bytes);
+    return ok;
+}
+
+bool load_tablebase(const char* path) {
+    if (tablebases_length == MAX_TABLEBASES) return false;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size >= (off_t)sizeof(tb_header)) data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (data == MAP_FAILED) return false;
+
+    tablebase t = {};
+    t.data = (const uint8_t*)data, t.bytes = st.st_size;
+    const tb_header& header = *(const tb_header*)data;
+    bool ok = !memcmp(header.magic, "MKTB", 4) && header.version == TB_VERSION && header.block_size == TB_BLOCK_SIZE
+        && header.length >= 2 && header.length <= MAX_TB_PIECES;
+    if (ok) {
+        t.length = header.length;
+        for (uint8_t i = 0; i < t.length; i ++) t.pieces[i] = piece(header.pieces[i]);
+        char name[16];
+        uint8_t length;
+        tablebase_name(t.pieces, t.length, name);
+        ok = parse_tablebase_name(name, t.pieces, length) && length == t.length // kings and table order
+            && header.blocks == (tablebase_size(t.pieces, t.length) + TB_BLOCK_SIZE - 1) / TB_BLOCK_SIZE
+            && sizeof(tb_header) + (2ull * header.blocks + 1) * sizeof(uint64_t) <= t.bytes;
+    }
+    if (ok) {
+        t.material = material_code(t.pieces, t.length);
+        t.blocks = header.blocks;
+        t.offsets = (const uint64_t*)(t.data + sizeof(tb_header));
+        t.compressed = (const uint8_t*)(t.offsets + 2 * t.blocks + 1);
+        ok = t.offsets[2 * t.blocks] <= t.bytes - (t.compressed - t.data);
+        bool swapped;
+        ok = ok && !find_tablebase(t.material, swapped);
+    }
+    if (!ok) {
+        munmap(data, st.st_size);
+        return false;
+    }
+    madvise(data, st.st_size, MADV_RANDOM);
+    tablebases[tablebases_length ++] = t;
+    if (t.length > tablebase_pieces) tablebase_pieces = t.length;
+    return true;
+}
+
+uint32_t load_tablebases(const char* directory) {
+    DIR* dir = opendir(directory);
+    if (!dir) return 0;
+    uint32_t loaded = 0;
+    while (dirent* entry = readdir(dir)) {
+        size_t length = strlen(entry->d_name);
+        if (length < 5 || strcmp(entry->d_name + length - 4, ".mtb")) continue;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        loaded += load_tablebase(path);
+    }
+    closedir(dir);
+    return loaded;
+}
+
+void unload_tablebases() {
+    for (uint32_t i = 0; i < tablebases_length; i ++) munmap((void*)tablebases[i].data, tablebases[i].bytes);
+    tablebases_length = tablebase_pieces = 0;
+}
+
+bool probe_tablebase(const game& g, color c, tb_result& r) {
+    if (g.white_left_castle || g.white_right_castle || g.black_left_castle || g.black_right_castle) return false;
+    uint8_t length = __builtin_popcountll(g.pieces);
+    if (length > MAX_TB_PIECES) return false;
+    piece pieces[MAX_TB_PIECES];
+    uint8_t squares[MAX_TB_PIECES];
+    uint8_t i = 0;
+    for (pieces_set rest = g.pieces; rest; rest &= rest - 1, i ++) {
+        squares[i] = __builtin_ctzll(rest);
+        pieces[i] = get_piece(g.b, squares[i] % 8, squares[i] / 8);
+    }
+    uint32_t code = material_code(pieces, length);
+    if (cannot_mate(code)) {
+        r = { 0, 0 };
+        return true;
+    }
+    bool swapped;
+    const tablebase* t = find_tablebase(code, swapped);
+    if (!t) return false;
+    if (swapped) { // look the position up upside down, with the colors swapped
+        for (i = 0; i < length; i ++) pieces[i] = piece(pieces[i] ^ BLACK), squares[i] ^= 56;
+        c = c == WHITE ? BLACK : WHITE;
+    }
+
+    uint8_t ordered[MAX_TB_PIECES];
+    for (uint8_t slot = 0; slot < length; slot ++) {
+        for (i = 0; pieces[i] != t->pieces[slot]; i ++);
+        ordered[slot] = squares[i];
+        pieces[i] = EMPTY; // taken, for tables with two of a piece
+    }
+    uint64_t index = tablebase_index(t->pieces, ordered, length, c);
+    if (index == TB_NO_INDEX) return false;
+    uint32_t block = index / TB_BLOCK_SIZE, left = index % TB_BLOCK_SIZE;
+    uint8_t outcome = decompress(t->compressed + t->offsets[block], left / 4) >> 2 * (left % 4) & 3;
+    if (!outcome) {
+        r = { 0, 0 };
+        return true;
+    }
+    uint8_t moves = decompress(t->compressed + t->offsets[t->blocks + block], left);
+    r.wdl = outcome == 1 ? 1 : -1;
+    r.plies = outcome == 1 ? 2 * moves - 1 : 2 * moves;
+    return true;
+}
@@ -0,0 +1,41 @@
+#ifndef TABLEBASE_H
+#define TABLEBASE_H
+
+#include "chess.h"
+
+#define MAX_TB_PIECES 5
+
+// One byte per position while generating, from the side to move's point of view: TB_DRAW, or
+// the plies to mate plus one, odd plies being a win and even ones a loss. Positions without
+// castling rights.
+#define TB_DRAW 0
+#define TB_ILLEGAL 255 // while generating: the side not to move is in check, or another index has it
+#define TB_MAX_PLIES 252
+#define TB_NO_INDEX UINT64_MAX // the kings stand next to each other
+
+struct tb_result {
+    int8_t wdl; // 1 if the side to move wins, -1 if it loses, 0 for a draw
+    uint8_t plies; // to mate, with best play from both sides
+};
+
+extern uint8_t tablebase_pieces; // most pieces in a loaded table, 0 if none are
+
+// A table's pieces are white's king and others by falling value, then black's the same way.
+// Names look like "KQvKR"; each table also covers the same material with the colors swapped.
+bool parse_tablebase_name(const char* name, piece* pieces, uint8_t& length);
+void tablebase_name(const piece* pieces, uint8_t length, char* buffer); // at least 16 long
+// Positions are indexed by where the kings stand, up to the board's symmetries (its 8 without
+// pawns, left and right with them), then by each other piece's square among those still empty.
+uint64_t tablebase_size(const piece* pieces, uint8_t length); // in positions
+uint64_t tablebase_index(const piece* pieces, const uint8_t* squares, uint8_t length, color c); // squares in table order
+// the squares at an index, which may not index back to it or be a position at all
+color tablebase_squares(const piece* pieces, uint8_t length, uint64_t index, uint8_t* squares);
+
+bool has_tablebase(const piece* pieces, uint8_t length); // loaded, or too little material to mate
+bool write_tablebase(const char* path, const piece* pieces, uint8_t length, const uint8_t* values);
+bool load_tablebase(const char* path);
+uint32_t load_tablebases(const char* directory); // every .mtb file in it, returns how many loaded
+void unload_tablebases();
+bool probe_tablebase(const game& g, color c, tb_result& r); // false if no table has the position
+
+#endif
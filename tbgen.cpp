@@ -0,0 +1,247 @@
+#include "chess.h"
+#include "tablebase.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+// Builds endgame tables by retrograde analysis. Mates are found with add_moves(), then each
+// pass walks back one ply from the positions resolved in the last: a position is won once a
+// move reaches a lost one, and lost once every move reaches a won one. Captures and
+// promotions leave the table, so the tables they lead to are built first.
+#define TB_UNKNOWN 254 // while generating
+#define TB_NEVER 255 // for counters, when the position has a move that doesn't lose
+
+struct generator {
+    piece pieces[MAX_TB_PIECES];
+    uint8_t length;
+    uint64_t size;
+    uint8_t* values;
+    uint8_t* counters; // positions in the table that moves reach which aren't won yet
+    uint8_t* pending; // plies at which moves leaving the table resolve the position, 0 if none
+};
+
+// false if pieces overlap, or a pawn stands where it never could
+static bool setup_position(game& g, const piece* pieces, const uint8_t* squares, uint8_t length) {
+    pieces_set taken = 0;
+    for (uint8_t i = 0; i < length; i ++) {
+        if (taken >> squares[i] & 1) return false;
+        if (get_kind(pieces[i]) == PAWN && (squares[i] < 8 || squares[i] >= 56)) return false;
+        taken |= 1ull << squares[i];
+    }
+    empty_game(g);
+    for (uint8_t i = 0; i < length; i ++) set_piece(g.b, squares[i] % 8, squares[i] / 8, pieces[i]);
+    update_game_state(g);
+    return true;
+}
+
+// drops repeated indices, returning how many are left: when the board's symmetries turn two
+// positions into one, moves between them must only count once
+static uint16_t distinct(uint64_t* indices, uint16_t length) {
+    uint16_t kept = 0;
+    for (uint16_t i = 0; i < length; i ++) {
+        uint16_t j = 0;
+        while (j < kept && indices[j] != indices[i]) j ++;
+        if (j == kept) indices[kept ++] = indices[i];
+    }
+    return kept;
+}
+
+static bool classify(generator& gen, uint64_t index) {
+    uint8_t squares[MAX_TB_PIECES];
+    color c = tablebase_squares(gen.pieces, gen.length, index, squares);
+    color other = c == WHITE ? BLACK : WHITE;
+    gen.counters[index] = TB_NEVER, gen.pending[index] = 0;
+    game g;
+    if (tablebase_index(gen.pieces, squares, gen.length, c) != index // another index has it the right way round
+        || !setup_position(g, gen.pieces, squares, gen.length) || (other == WHITE ? g.white_in_check : g.black_in_check)) {
+        gen.values[index] = TB_ILLEGAL;
+        return true;
+    }
+    gen.values[index] = TB_UNKNOWN;
+    move_list list;
+    add_moves(g, c, list);
+    if (!list.length) {
+        gen.values[index] = (c == WHITE ? g.white_in_check : g.black_in_check) ? 1 : TB_DRAW;
+        return true;
+    }
+
+    uint64_t reached[MAX_MOVES];
+    uint16_t inside = 0;
+    uint8_t win = 0, loss = 0;
+    bool draw = false;
+    for (uint16_t i = 0; i < list.length; i ++) {
+        move m = list.moves[i];
+        if (!m.capture && !is_promotion(m)) {
+            uint8_t next[MAX_TB_PIECES], src = m.src_y * 8 + m.src_x;
+            for (uint8_t j = 0; j < gen.length; j ++) next[j] = squares[j] == src ? m.dst_y * 8 + m.dst_x : squares[j];
+            reached[inside ++] = tablebase_index(gen.pieces, next, gen.length, other);
+            continue;
+        }
+        game next = g;
+        move_piece(next, m);
+        tb_result r;
+        if (!probe_tablebase(next, other, r)) return false;
+        if (r.wdl < 0 && (!win || r.plies + 1 < win)) win = r.plies + 1;
+        else if (r.wdl == 0) draw = true;
+        else if (r.wdl > 0 && r.plies + 1 > loss) loss = r.plies + 1;
+    }
+    inside = distinct(reached, inside);
+    if (win) gen.pending[index] = win;
+    else if (!draw) {
+        gen.counters[index] = inside, gen.pending[index] = loss;
+        if (!inside) gen.values[index] = loss + 1; // every move leaves the table, nothing to wait for
+    }
+    return true;
+}
+
+// the positions one move before the resolved position at index, in the table
+static void resolve_predecessors(generator& gen, uint64_t index, uint8_t plies) {
+    uint8_t squares[MAX_TB_PIECES];
+    color c = tablebase_squares(gen.pieces, gen.length, index, squares);
+    color mover = c == WHITE ? BLACK : WHITE;
+    pieces_set taken = 0;
+    for (uint8_t i = 0; i < gen.length; i ++) taken |= 1ull << squares[i];
+
+    uint64_t previous[MAX_MOVES];
+    uint16_t length = 0;
+    for (uint8_t i = 0; i < gen.length; i ++) {
+        if (get_color(gen.pieces[i]) != mover) continue;
+        uint8_t sq = squares[i];
+        targets_set from;
+        if (get_kind(gen.pieces[i]) == PAWN) {
+            int8_t back = mover == WHITE ? -8 : 8;
+            uint8_t rank = mover == WHITE ? sq / 8 : 7 - sq / 8;
+            from = rank >= 2 ? 1ull << (sq + back) : 0;
+            if (rank == 3 && !(taken >> (sq + back) & 1)) from |= 1ull << (sq + 2 * back); // two squares
+        }
+        else from = piece_targets(gen.pieces[i], sq, taken);
+        from &= ~taken;
+
+        for (; from; from &= from - 1) {
+            squares[i] = __builtin_ctzll(from);
+            uint64_t at = tablebase_index(gen.pieces, squares, gen.length, mover);
+            if (at != TB_NO_INDEX && gen.values[at] == TB_UNKNOWN) previous[length ++] = at;
+        }
+        squares[i] = sq;
+    }
+
+    length = distinct(previous, length);
+    for (uint16_t i = 0; i < length; i ++) {
+        uint64_t at = previous[i];
+        if (plies % 2 == 0) gen.values[at] = plies + 2; // reaches a lost position: won
+        else if (gen.counters[at] != TB_NEVER && !-- gen.counters[at] && gen.pending[at] <= plies + 1) {
+            gen.values[at] = plies + 2; // every move reaches a won position: lost
+        }
+    }
+}
+
+// puts tables the right way up, so the side with more material is white and names it first
+static void stronger_first(piece* pieces, uint8_t length) {
+    score balance = 0;
+    for (uint8_t i = 0; i < length; i ++) {
+        if (get_kind(pieces[i]) != KING) balance += get_color(pieces[i]) == WHITE ? piece_values[get_kind(pieces[i])] : -piece_values[get_kind(pieces[i])];
+    }
+    if (balance >= 0) return;
+    char name[16];
+    for (uint8_t i = 0; i < length; i ++) pieces[i] = piece(pieces[i] ^ BLACK);
+    tablebase_name(pieces, length, name);
+    parse_tablebase_name(name, pieces, length);
+}
+
+static bool generate(const char* directory, piece* pieces, uint8_t length) {
+    stronger_first(pieces, length);
+    if (has_tablebase(pieces, length)) return true;
+    // the tables that captures and promotions lead to
+    for (uint8_t i = 0; i < length; i ++) {
+        if (get_kind(pieces[i]) == KING) continue;
+        piece rest[MAX_TB_PIECES];
+        uint8_t rest_length = 0;
+        for (uint8_t j = 0; j < length; j ++) if (j != i) rest[rest_length ++] = pieces[j];
+        if (!generate(directory, rest, rest_length)) return false;
+        for (uint8_t k = KNIGHT; k < KING && get_kind(pieces[i]) == PAWN; k ++) {
+            char name[16];
+            memcpy(rest, pieces, length * sizeof(piece));
+            rest[i] = make_piece(get_color(pieces[i]), kind(k));
+            tablebase_name(rest, length, name);
+            parse_tablebase_name(name, rest, rest_length); // back into table order
+            if (!generate(directory, rest, rest_length)) return false;
+        }
+    }
+
+    char name[16], path[4096];
+    tablebase_name(pieces, length, name);
+    snprintf(path, sizeof(path), "%s/%s.mtb", directory, name);
+    printf("%s: ", name);
+    fflush(stdout);
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    generator gen;
+    memcpy(gen.pieces, pieces, length * sizeof(piece));
+    gen.length = length;
+    gen.size = tablebase_size(pieces, length);
+    gen.values = (uint8_t*)malloc(gen.size), gen.counters = (uint8_t*)malloc(gen.size), gen.pending = (uint8_t*)malloc(gen.size);
+    bool ok = gen.values && gen.counters && gen.pending;
+    uint8_t last = 0; // furthest plies a move out of the table resolves a position at
+    for (uint64_t i = 0; i < gen.size && ok; i ++) {
+        ok = classify(gen, i);
+        if (gen.values[i] == TB_UNKNOWN && gen.pending[i] > last) last = gen.pending[i];
+    }
+
+    uint8_t longest = 0;
+    for (uint8_t plies = 0; ok && plies < TB_MAX_PLIES; plies ++) {
+        bool found = false;
+        for (uint64_t i = 0; i < gen.size; i ++) {
+            uint8_t value = gen.values[i];
+            if (value == plies + 1) {
+                resolve_predecessors(gen, i, plies);
+                found = true;
+            }
+            else if (value == TB_UNKNOWN && gen.pending[i] == plies + 1 && (gen.counters[i] == 0 || gen.counters[i] == TB_NEVER)) {
+                gen.values[i] = plies + 2;
+            }
+        }
+        if (found) longest = plies;
+        else if (plies >= last) break;
+    }
+
+    uint64_t wins = 0, losses = 0, draws = 0;
+    for (uint64_t i = 0; i < gen.size && ok; i ++) {
+        uint8_t& value = gen.values[i];
+        if (value == TB_UNKNOWN) value = TB_DRAW; // neither side can force mate
+        if (value == TB_DRAW) draws ++;
+        else if (value != TB_ILLEGAL) (value % 2 == 0 ? wins : losses) ++;
+    }
+    ok = ok && write_tablebase(path, pieces, length, gen.values) && load_tablebase(path);
+    free(gen.values), free(gen.counters), free(gen.pending);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!ok) {
+        printf("failed.\n");
+        return false;
+    }
+    printf("%llu won, %llu lost, %llu drawn, longest mate in %u plies, %.1fs\n", (unsigned long long)wins,
+        (unsigned long long)losses, (unsigned long long)draws, longest, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    // tbgen <directory> <table>...
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <directory> <table>...\n", argv[0]);
+        fprintf(stderr, " - table: the pieces of each side, e.g. 'KQvK' or 'KRPvKR', %d at most\n", MAX_TB_PIECES);
+        fprintf(stderr, "Tables already in the directory are reused, missing ones that captures or promotions lead to are built too.\n");
+        return 1;
+    }
+    load_tablebases(argv[1]);
+    for (int i = 2; i < argc; i ++) {
+        piece pieces[MAX_TB_PIECES];
+        uint8_t length;
+        if (!parse_tablebase_name(argv[i], pieces, length)) {
+            fprintf(stderr, "Not a table: '%s'.\n", argv[i]);
+            return 1;
+        }
+        if (!generate(argv[1], pieces, length)) return 1;
+    }
+    return 0;
+}
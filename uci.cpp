@@ -0,0 +1,237 @@
+#include "uci.h"
+#include "search.h"
+#include "tablebase.h"
+#include "nnue.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <strings.h>
+
+static uint32_t move_overhead_ms = 30; // lost to the GUI and the OS on every move
+
+// the position being analysed and the search running on it, if any
+struct uci_state {
+    game g;
+    color c;
+    search_limits limits;
+    bool infinite; // bestmove has to wait for 'stop' even if the search ends first
+    bool stop;
+    bool running;
+    pthread_t thread;
+};
+
+static uci_state state;
+
+// Splits the clock between the moves left. Without a 'movestogo' the game is assumed to
+// last another 30 moves or so; most of the increment is spent, and at most half of what's
+// left on the clock, so a long think never loses on time.
+static uint32_t plan_time(uint32_t time_left, uint32_t increment, uint32_t moves_to_go) {
+    if (!moves_to_go || moves_to_go > 30) moves_to_go = 30;
+    uint64_t budget = time_left / moves_to_go + increment * 3 / 4;
+    if (budget > time_left / 2) budget = time_left / 2;
+    budget = budget > move_overhead_ms ? budget - move_overhead_ms : 1;
+    return budget;
+}
+
+// follows the best moves stored in the table, as long as they're legal
+static void print_pv(const game& g, color c, move best, uint8_t depth) {
+    game copy = g;
+    char name[8];
+    for (uint8_t i = 0; i < depth && best != INVALID_MOVE && is_legal(copy, c, best); i ++) {
+        move_to_string(best, name);
+        printf(" %s", name);
+        move_piece(copy, best);
+        c = c == WHITE ? BLACK : WHITE;
+        tt_hit hit;
+        best = probe_table(search_table, game_key(copy, c), hit) ? hit.best : INVALID_MOVE;
+    }
+}
+
+static void report(const game& g, color c, const search_result& progress) {
+    printf("info depth %u", progress.depth);
+    if (progress.value >= MATE_SCORE - MAX_PLY) printf(" score mate %lld", (long long)(MATE_SCORE - progress.value + 1) / 2);
+    else if (progress.value <= -MATE_SCORE + MAX_PLY) printf(" score mate -%lld", (long long)(MATE_SCORE + progress.value) / 2);
+    else printf(" score cp %lld", (long long)progress.value);
+    printf(" nodes %llu time %u nps %llu pv", (unsigned long long)progress.nodes, progress.elapsed_ms,
+        (unsigned long long)(progress.nodes * 1000 / (progress.elapsed_ms ? progress.elapsed_ms : 1)));
+    print_pv(g, c, progress.best, progress.depth);
+    printf("\n");
+    fflush(stdout);
+}
+
+static void* run_search(void* arg) {
+    uci_state& st = *(uci_state*)arg;
+    move_list list;
+    add_moves(st.g, st.c, list);
+    search_result result = search(st.g, st.c, list, st.limits);
+    while (st.infinite && !__atomic_load_n(&st.stop, __ATOMIC_RELAXED)) {
+        timespec pause = { 0, 1000000 };
+        nanosleep(&pause, nullptr);
+    }
+    char name[8] = "0000"; // no legal moves
+    if (list.length) move_to_string(result.best, name);
+    printf("bestmove %s\n", name);
+    fflush(stdout);
+    return nullptr;
+}
+
+static void stop_search() {
+    if (!state.running) return;
+    __atomic_store_n(&state.stop, true, __ATOMIC_RELAXED);
+    pthread_join(state.thread, nullptr);
+    state.running = false;
+}
+
+// position startpos|fen <fen> [moves <move>...]
+static void set_position(char* args) {
+    char* moves = strstr(args, "moves");
+    if (moves) *moves = '\0', moves += 5;
+    const char* kind = strtok(args, " \r\t\n");
+    if (kind && !strcmp(kind, "startpos")) {
+        setup_game(state.g);
+        state.c = WHITE;
+    }
+    else if (kind && !strcmp(kind, "fen")) {
+        const char* fen = strtok(nullptr, "\r\n");
+        color c = fen ? game_from_fen(state.g, fen) : INVALID_COLOR;
+        if (c == INVALID_COLOR) {
+            printf("info string invalid fen\n");
+            setup_game(state.g);
+        }
+        state.c = c == INVALID_COLOR ? WHITE : c;
+    }
+    if (!moves) return;
+    for (const char* name = strtok(moves, " \r\t\n"); name; name = strtok(nullptr, " \r\t\n")) {
+        move m = move_from_string(state.g, state.c, name);
+        if (m == INVALID_MOVE) {
+            printf("info string illegal move %s\n", name);
+            return;
+        }
+        move_piece(state.g, m);
+        state.c = state.c == WHITE ? BLACK : WHITE;
+    }
+}
+
+// the go arguments followed by a value; the rest, like infinite and ponder, stand alone
+static const char* const go_values[] = { "wtime", "btime", "winc", "binc", "movestogo", "movetime", "depth", "nodes" };
+
+static bool takes_value(const char* arg) {
+    for (const char* name : go_values) if (!strcmp(arg, name)) return true;
+    return false;
+}
+
+// go [wtime <ms>] [btime <ms>] [winc <ms>] [binc <ms>] [movestogo <n>] [movetime <ms>] [depth <n>] [nodes <n>] [infinite]
+static void go(char* args) {
+    uint32_t time_left[2] = {}, increment[2] = {}, moves_to_go = 0, move_time = 0, depth = 0;
+    uint64_t nodes = 0;
+    bool infinite = false;
+    for (const char* arg = strtok(args, " \r\t\n"); arg; arg = strtok(nullptr, " \r\t\n")) {
+        if (!strcmp(arg, "infinite")) infinite = true;
+        if (!takes_value(arg)) continue;
+        const char* value_string = strtok(nullptr, " \r\t\n");
+        if (!value_string) break;
+        long long value = atoll(value_string);
+        if (value < 0) value = 0; // clocks can run slightly negative
+        if (!strcmp(arg, "wtime")) time_left[0] = value;
+        else if (!strcmp(arg, "btime")) time_left[1] = value;
+        else if (!strcmp(arg, "winc")) increment[0] = value;
+        else if (!strcmp(arg, "binc")) increment[1] = value;
+        else if (!strcmp(arg, "movestogo")) moves_to_go = value;
+        else if (!strcmp(arg, "movetime")) move_time = value;
+        else if (!strcmp(arg, "depth")) depth = value;
+        else if (!strcmp(arg, "nodes")) nodes = value;
+    }
+
+    uint8_t side = state.c == WHITE ? 0 : 1;
+    uint32_t time_ms = 0;
+    if (move_time) time_ms = move_time > move_overhead_ms ? move_time - move_overhead_ms : 1;
+    else if (time_left[side]) time_ms = plan_time(time_left[side], increment[side], moves_to_go);
+
+    state.limits = { time_ms, nodes, uint8_t(depth < MAX_PLY ? depth : MAX_PLY), search_threads, &state.stop, report, nullptr };
+    state.infinite = infinite;
+    state.stop = false;
+    state.running = !pthread_create(&state.thread, nullptr, run_search, &state);
+}
+
+// setoption name <name> [value <value>], names being case-insensitive and possibly several words
+static void set_option(char* args) {
+    char name[64] = "";
+    const char* value = "";
+    bool in_name = false;
+    for (const char* token = strtok(args, " \r\t\n"); token; token = strtok(nullptr, " \r\t\n")) {
+        if (!strcmp(token, "name")) in_name = true;
+        else if (!strcmp(token, "value")) {
+            value = strtok(nullptr, "\r\n");
+            if (!value) value = "";
+            break;
+        }
+        else if (in_name && strlen(name) + strlen(token) + 2 < sizeof(name)) {
+            if (*name) strcat(name, " ");
+            strcat(name, token);
+        }
+    }
+    if (!strcasecmp(name, "Hash")) search_hash_mb = atoi(value);
+    else if (!strcasecmp(name, "Threads") && atoi(value) > 0 && atoi(value) < 256) search_threads = atoi(value);
+    else if (!strcasecmp(name, "Move Overhead")) move_overhead_ms = atoi(value);
+    else if (!strcasecmp(name, "Huge Pages")) search_huge_pages = !strcmp(value, "true");
+    else if (!strcasecmp(name, "Clear Hash")) clear_table(search_table);
+    else if (!strcasecmp(name, "EvalFile")) {
+        if (!*value || !strcmp(value, "<empty>")) unload_network();
+        else if (!load_network(value)) printf("info string could not load network '%s'\n", value);
+    }
+    else if (!strcasecmp(name, "Tablebase Path")) {
+        unload_tablebases();
+        if (*value) printf("info string loaded %u tables\n", load_tablebases(value));
+    }
+    else printf("info string unknown option '%s'\n", name);
+}
+
+void uci_loop() {
+    setup_game(state.g);
+    state.c = WHITE;
+    char buffer[8192]; // long games make long 'position' lines
+    while (fgets(buffer, sizeof(buffer), stdin)) {
+        char* args = buffer;
+        while (*args == ' ' || *args == '\t') args ++;
+        char* cmd = args;
+        while (*args && *args != ' ' && *args != '\t' && *args != '\r' && *args != '\n') args ++;
+        if (*args) *args++ = '\0';
+
+        if (!strcmp(cmd, "uci")) {
+            printf("id name Mockfish 0.1\n");
+            printf("id author the Mockfish developers\n");
+            printf("option name Hash type spin default %u min 0 max 65536\n", search_hash_mb);
+            printf("option name Threads type spin default %u min 1 max 255\n", search_threads);
+            printf("option name Move Overhead type spin default %u min 0 max 5000\n", move_overhead_ms);
+            printf("option name Huge Pages type check default %s\n", search_huge_pages ? "true" : "false");
+            printf("option name Clear Hash type button\n");
+            printf("option name Tablebase Path type string default <empty>\n");
+            printf("option name EvalFile type string default %s\n", DEFAULT_NETWORK);
+            printf("uciok\n");
+        }
+        else if (!strcmp(cmd, "isready")) printf("readyok\n");
+        else if (!strcmp(cmd, "setoption")) {
+            stop_search();
+            set_option(args);
+        }
+        else if (!strcmp(cmd, "ucinewgame")) {
+            stop_search();
+            clear_table(search_table);
+        }
+        else if (!strcmp(cmd, "position")) {
+            stop_search();
+            set_position(args);
+        }
+        else if (!strcmp(cmd, "go")) {
+            stop_search();
+            go(args);
+        }
+        else if (!strcmp(cmd, "stop")) stop_search();
+        else if (!strcmp(cmd, "quit")) break;
+        else if (*cmd) printf("info string unknown command '%s'\n", cmd);
+        fflush(stdout);
+    }
+    stop_search();
+}
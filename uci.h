@@ -0,0 +1,8 @@
+#ifndef UCI_H
+#define UCI_H
+
+// talks the Universal Chess Interface on stdin and stdout until 'quit' or the end of input,
+// searching with alpha_beta's engine
+void uci_loop();
+
+#endif